@@ -0,0 +1,617 @@
+#include "ytt_generator.h"
+#include "subtitle_writers.h"
+#include "pipeline_stats.h"
+#include "synthetic_chat.h"
+#include <CLI/CLI.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <new>
+#include <vector>
+
+// Every heap allocation of the process is counted, so the benchmarks can report allocations per
+// message. Relaxed atomics add a few nanoseconds to an allocation, the same for every build.
+static std::atomic<uint64_t> allocationCount = 0;
+static std::atomic<uint64_t> allocatedBytes = 0;
+
+static void *countedAllocation(std::size_t size, std::size_t alignment) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    void *memory = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__
+                       ? std::malloc(size)
+#if defined(_WIN32)
+                       : _aligned_malloc(size, alignment);
+#else
+                       : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+    if (!memory) throw std::bad_alloc();
+    return memory;
+}
+
+// Not inlined: GCC would otherwise see operator new's memory reach free() and warn about a
+// mismatched deallocation (-Wmismatched-new-delete), although both sides are ours.
+[[gnu::noinline]] static void countedFree(void *memory, std::size_t alignment) {
+#if defined(_WIN32)
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) return _aligned_free(memory);
+#endif
+    (void) alignment;
+    std::free(memory);
+}
+
+// The array and nothrow forms call these.
+void *operator new(std::size_t size) {
+    return countedAllocation(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return countedAllocation(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *memory) noexcept {
+    countedFree(memory, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    countedFree(memory, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void *memory, std::align_val_t alignment) noexcept {
+    countedFree(memory, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *memory, std::size_t, std::align_val_t alignment) noexcept {
+    countedFree(memory, static_cast<std::size_t>(alignment));
+}
+
+// One benchmark of one stage at one chat size.
+struct BenchResult {
+    std::string stage;
+    size_t messages = 0;
+    size_t runs = 0;
+    double bestWall = 0;
+    double medianWall = 0;
+    double bestCpu = 0;
+    uint64_t bytes = 0; // CSV read by parse, document written by srv3/ass/end-to-end, 0 otherwise
+    std::string digest; // of the document written by srv3/ass, empty otherwise
+    uint64_t allocations = 0; // heap allocations of one run
+    uint64_t allocatedBytes = 0;
+    uint64_t loopAllocations = 0; // srv3/ass: allocations of the per-batch loop, see checkOutput()
+    uint64_t inputBytes = 0; // size of the chat CSV
+    std::string chat; // --complexity case, empty otherwise
+
+    double perMessage(uint64_t value) const {
+        return messages ? static_cast<double>(value) / static_cast<double>(messages) : 0;
+    }
+};
+
+// Runs step repeat times and keeps the result of the last run in result. Results are destroyed
+// outside the measured time, freeing a million batches is not part of batching them.
+template<typename T, typename Step>
+BenchResult measure(const std::string &stage, size_t messages, size_t repeat, T &result, Step &&step) {
+    std::vector<StageTime> times;
+    uint64_t allocations = 0, bytes = 0;
+    for (size_t run = 0; run < repeat; ++run) {
+        result = T{};
+        uint64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+        uint64_t bytesBefore = allocatedBytes.load(std::memory_order_relaxed);
+        StageClock clock;
+        T value = step();
+        times.push_back(clock.elapsed());
+        allocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+        bytes = allocatedBytes.load(std::memory_order_relaxed) - bytesBefore;
+        result = std::move(value);
+    }
+    std::ranges::sort(times, {}, &StageTime::wall);
+    BenchResult bench;
+    bench.stage = stage;
+    bench.messages = messages;
+    bench.runs = repeat;
+    bench.bestWall = times.front().wall;
+    bench.medianWall = times[times.size() / 2].wall;
+    bench.bestCpu = std::ranges::min(times, {}, &StageTime::cpu).cpu;
+    bench.allocations = allocations;
+    bench.allocatedBytes = bytes;
+    return bench;
+}
+
+// Hashes what it is given (64-bit FNV-1a), so outputs can be compared without storing them.
+class DigestBuffer : public std::streambuf {
+public:
+    std::string digest() const {
+        return std::format("{:016x}", hash);
+    }
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        for (std::streamsize i = 0; i < count; ++i) add(static_cast<unsigned char>(data[i]));
+        return count;
+    }
+
+    int overflow(int c) override {
+        if (c != traits_type::eof()) add(static_cast<unsigned char>(c));
+        return c;
+    }
+
+private:
+    void add(unsigned char c) {
+        hash = (hash ^ c) * 0x100000001B3ull;
+    }
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+};
+
+// Size of the document, which goes to sink.
+static uint64_t serialize(SubtitleEmitter &&emitter, const std::vector<Batch> &batches, std::streambuf &sink) {
+    std::ostream stream(&sink);
+    BufferedWriter out(&stream);
+    writeSubtitles(emitter, out, batches);
+    out.flush();
+    return out.size();
+}
+
+static uint64_t serialize(SubtitleEmitter &&emitter, const std::vector<Batch> &batches) {
+    DiscardBuffer discard;
+    return serialize(std::move(emitter), batches, discard);
+}
+
+// What an extra, unmeasured run of an emitter checks: the digest of its document and how often
+// its per-batch loop allocated after begin() set up the palette. That loop runs once per
+// message, so an allocation-free emitter allocates a fixed number of times however long the chat.
+struct OutputCheck {
+    std::string digest;
+    uint64_t loopAllocations = 0;
+};
+
+static OutputCheck checkOutput(SubtitleEmitter &&emitter, const std::vector<Batch> &batches) {
+    DigestBuffer sink;
+    std::ostream stream(&sink);
+    OutputCheck check;
+    {
+        BufferedWriter out(&stream);
+        emitter.begin(out, collectUserColors(batches));
+        uint64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+        for (size_t i = 0; i + 1 < batches.size(); ++i) emitter.batch(out, batches[i], batches[i + 1].time);
+        check.loopAllocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+        emitter.end(out);
+    }
+    check.digest = sink.digest();
+    return check;
+}
+
+static void printResult(const BenchResult &result) {
+    std::cout << std::format("{:<11} {:>9} {:>10.2f} {:>10.2f} {:>10.2f} {:>12.0f} {:>9.2f} {:>11.2f} {:>9.0f}\n",
+                             result.stage, result.messages, result.bestWall * 1000, result.medianWall * 1000,
+                             result.bestCpu * 1000, result.messages / result.bestWall,
+                             result.bytes / 1e6 / result.bestWall, result.perMessage(result.allocations),
+                             result.perMessage(result.allocatedBytes));
+}
+
+// The first line describes what was measured (chat and config), then one result per line; --baseline
+// reads the file back line by line.
+static void writeJson(std::ostream &out, const std::string &setup, const std::vector<BenchResult> &results) {
+    out << "{" << setup << ",\"results\":[";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto &result = results[i];
+        out << (i ? ",\n{" : "\n{");
+        if (!result.chat.empty()) out << std::format("\"case\":\"{}\",", result.chat);
+        out << std::format("\"stage\":\"{}\",\"input_bytes\":{},\"messages\":{},\"runs\":{},\"best_ms\":{:.3f},"
+                           "\"median_ms\":{:.3f},\"cpu_ms\":{:.3f},\"bytes\":{},\"messages_per_second\":{:.1f},\"mb_per_second\":{:.3f},"
+                           "\"allocations\":{},\"allocated_bytes\":{},\"loop_allocations\":{},\"digest\":\"{}\"}}",
+                           result.stage, result.inputBytes, result.messages, result.runs, result.bestWall * 1000,
+                           result.medianWall * 1000, result.bestCpu * 1000, result.bytes,
+                           result.messages / result.bestWall, result.bytes / 1e6 / result.bestWall,
+                           result.allocations, result.allocatedBytes, result.loopAllocations, result.digest);
+    }
+    out << std::format("\n],\"peak_rss_bytes\":{}}}\n", peakRssBytes());
+}
+
+// Value of "key": in a line written by writeJson, without quotes.
+static std::string jsonField(const std::string &line, std::string_view key) {
+    auto start = line.find(std::format("\"{}\":", key));
+    if (start == std::string::npos) return {};
+    start += key.size() + 3;
+    if (start < line.size() && line[start] == '"') {
+        auto end = line.find('"', start + 1);
+        return line.substr(start + 1, end == std::string::npos ? std::string::npos : end - start - 1);
+    }
+    return line.substr(start, line.find_first_of(",}", start) - start);
+}
+
+struct BaselineResult {
+    double bestMs = 0;
+    uint64_t allocations = 0;
+    std::string digest;
+};
+
+// Results of a --json file by stage and chat size. Throws std::runtime_error when the file cannot be
+// read or measured something else than setup.
+static std::map<std::pair<std::string, size_t>, BaselineResult> readBaseline(const std::filesystem::path &path,
+                                                                             const std::string &setup) {
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line)) throw std::runtime_error("Cannot read baseline " + path.string());
+    if (line != "{" + setup + ",\"results\":[") {
+        throw std::runtime_error("Baseline " + path.string() + " was made with another chat or config");
+    }
+    std::map<std::pair<std::string, size_t>, BaselineResult> baseline;
+    while (std::getline(in, line)) {
+        auto stage = jsonField(line, "stage");
+        if (stage.empty()) continue;
+        try {
+            baseline[{stage, std::stoull(jsonField(line, "messages"))}] = {
+                std::stod(jsonField(line, "best_ms")), std::stoull(jsonField(line, "allocations")),
+                jsonField(line, "digest")
+            };
+        } catch (const std::logic_error &) {
+            throw std::runtime_error("Invalid result in baseline " + path.string() + ": " + line);
+        }
+    }
+    return baseline;
+}
+
+// Prints every result next to its baseline. A result fails when its output differs, when it
+// allocates more often (the count does not depend on timing) or when its best time exceeds the
+// baseline's by more than tolerance (0.2 = 20%); returns the number of failures.
+static size_t compareBaseline(const std::vector<BenchResult> &results,
+                              const std::map<std::pair<std::string, size_t>, BaselineResult> &baseline,
+                              double tolerance) {
+    size_t failures = 0;
+    std::cout << std::format("{:<11} {:>9} {:>10} {:>11} {:>8}  {}\n", "stage", "messages", "best ms",
+                             "baseline ms", "change", "result");
+    for (const auto &result: results) {
+        auto it = baseline.find({result.stage, result.messages});
+        if (it == baseline.end()) {
+            std::cout << std::format("{:<11} {:>9} {:>10.2f} {:>11} {:>8}  no baseline\n", result.stage,
+                                     result.messages, result.bestWall * 1000, "-", "-");
+            continue;
+        }
+        double change = result.bestWall * 1000 / it->second.bestMs - 1;
+        std::string verdict = "ok";
+        if (result.digest != it->second.digest) {
+            verdict = "FAIL: output changed";
+        } else if (result.allocations > it->second.allocations) {
+            verdict = std::format("FAIL: {} more allocations", result.allocations - it->second.allocations);
+        } else if (change > tolerance) {
+            verdict = "FAIL: slower";
+        }
+        if (verdict != "ok") failures++;
+        std::cout << std::format("{:<11} {:>9} {:>10.2f} {:>11.2f} {:>+7.1f}%  {}\n", result.stage, result.messages,
+                                 result.bestWall * 1000, it->second.bestMs, change * 100, verdict);
+    }
+    return failures;
+}
+
+// 64-bit FNV-1a of a file, to tell configs apart.
+static std::string fileDigest(const std::filesystem::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    DigestBuffer digest;
+    std::ostream(&digest) << in.rdbuf();
+    return digest.digest();
+}
+
+// Every stage on its own, each fed with the output of the previous one, then the whole pipeline
+// from CSV text to an SRV3 document. SRV3 and ASS get an extra, unmeasured run for checkOutput().
+static void benchChat(const std::string &csv, int timeMultiplier, const ChatParams &params, size_t repeat,
+                      int videoWidth, int videoHeight, std::vector<BenchResult> &results) {
+    auto run = [&](BenchResult result, uint64_t bytes) {
+        result.bytes = bytes;
+        result.inputBytes = csv.size();
+        printResult(result);
+        results.push_back(std::move(result));
+    };
+
+    std::vector<ChatMessage> messages;
+    auto parsed = measure("parse", 0, repeat, messages, [&] {
+        std::istringstream in(csv);
+        return parseCSV(in, timeMultiplier, "benchmark chat");
+    });
+    const size_t size = parsed.messages = messages.size();
+    run(parsed, csv.size());
+
+    std::vector<WrappedMessage> wrapped;
+    run(measure("wrap", size, repeat, wrapped, [&] { return wrapMessages(messages, params); }), 0);
+
+    std::vector<Batch> batches;
+    run(measure("batch", size, repeat, batches, [&] {
+        return generateBatches(wrapped, params.totalDisplayLines);
+    }), 0);
+    wrapped = {};
+
+    // The document size is only known once measure() returned.
+    uint64_t documentBytes = 0;
+    auto srv3 = measure("srv3", size, repeat, documentBytes, [&] {
+        return serialize(Srv3Emitter(params), batches);
+    });
+    auto srv3Check = checkOutput(Srv3Emitter(params), batches);
+    srv3.digest = srv3Check.digest;
+    srv3.loopAllocations = srv3Check.loopAllocations;
+    run(srv3, documentBytes);
+    auto ass = measure("ass", size, repeat, documentBytes, [&] {
+        return serialize(AssEmitter(params, videoWidth, videoHeight), batches);
+    });
+    auto assCheck = checkOutput(AssEmitter(params, videoWidth, videoHeight), batches);
+    ass.digest = assCheck.digest;
+    ass.loopAllocations = assCheck.loopAllocations;
+    run(ass, documentBytes);
+    batches = {};
+    messages = {};
+
+    auto endToEnd = measure("end-to-end", size, repeat, documentBytes, [&] {
+        std::istringstream in(csv);
+        auto chat = parseCSV(in, timeMultiplier, "benchmark chat");
+        return serialize(Srv3Emitter(params), generateBatches(wrapMessages(chat, params), params.totalDisplayLines));
+    });
+    run(endToEnd, documentBytes);
+}
+
+// Inputs made to find super-linear work: each grows with scale, and --complexity checks that the
+// time of every stage grows no faster than the input.
+struct ComplexityCase {
+    std::string_view name;
+    std::string (*chat)(size_t scale);
+};
+
+static const ComplexityCase complexityCases[] = {
+    {"long-word", [](size_t scale) {
+        // One word of scale × 128 KiB, cut into thousands of lines.
+        return std::string(csvHeader) + "\n0,user,,\"" + std::string(scale << 17, 'w') + "\"\n";
+    }},
+    {"long-utf8-word", [](size_t scale) {
+        std::string word;
+        for (size_t i = 0; i < scale << 15; ++i) word += "яд😂";
+        return std::string(csvHeader) + "\n0,user,,\"" + word + "\"\n";
+    }},
+    {"combining-username", [](size_t scale) {
+        // Each combining mark is a code point of its own, so the name is cut after a few of them.
+        std::string name = "u";
+        for (size_t i = 0; i < scale * 5000; ++i) name += "\xCC\x81";
+        std::string csv(csvHeader);
+        for (int i = 0; i < 100; ++i) csv += std::format("\n{},{},,hi", i * 100, name);
+        return csv + "\n";
+    }},
+    {"long-message", [](size_t scale) {
+        std::string message;
+        for (size_t i = 0; i < scale << 15; ++i) message += "ab c ";
+        return std::string(csvHeader) + "\n0,user,,\"" + message + "\"\n";
+    }},
+    {"same-timestamp", [](size_t scale) {
+        // Messages sharing a time only ever make one batch.
+        std::string csv(csvHeader);
+        for (size_t i = 0; i < scale * 25000; ++i) csv += std::format("\n1000,user{},,message {}", i % 100, i);
+        return csv + "\n";
+    }},
+    {"markup", [](size_t scale) {
+        std::string csv(csvHeader);
+        for (size_t i = 0; i < scale * 10000; ++i) csv += std::format("\n{},<b>&{},#F00,<&>\"'{{\\N}}</p>", i, i % 50);
+        return csv + "\n";
+    }},
+};
+
+// Runs every case at 1, 2, 4 and 8 times its size and prints how fast each stage's time grows with
+// the input from 2 to 8 times: its exponent, 1 for linear and 2 for quadratic work. Stages that stay
+// under a millisecond are too noisy to judge. Returns the number of stages growing faster than maxExponent.
+static size_t runComplexity(const ChatParams &params, size_t repeat, int videoWidth, int videoHeight,
+                            double maxExponent, std::vector<BenchResult> &results) {
+    constexpr size_t scales[] = {1, 2, 4, 8};
+    size_t failures = 0;
+    for (const auto &complexityCase: complexityCases) {
+        std::cout << "\n" << complexityCase.name << "\n";
+        size_t first = results.size();
+        for (size_t scale: scales) {
+            size_t before = results.size();
+            benchChat(complexityCase.chat(scale), 1, params, repeat, videoWidth, videoHeight, results);
+            for (size_t i = before; i < results.size(); ++i) results[i].chat = complexityCase.name;
+        }
+        // benchChat adds the same stages in the same order for every scale.
+        size_t stages = (results.size() - first) / std::size(scales);
+        for (size_t stage = 0; stage < stages; ++stage) {
+            // From the second scale on: the smallest inputs may still fit in the caches.
+            const auto &smallest = results[first + stage + stages];
+            const auto &largest = results[first + stage + (std::size(scales) - 1) * stages];
+            double exponent = std::log(largest.bestWall / smallest.bestWall) /
+                              std::log(static_cast<double>(largest.inputBytes) / smallest.inputBytes);
+            std::string verdict = "ok";
+            if (largest.bestWall < 1e-3) {
+                verdict = "too fast to judge";
+            } else if (exponent > maxExponent) {
+                verdict = "FAIL: super-linear";
+                failures++;
+            }
+            std::cout << std::format("  {:<11} {:>9.2f} ms -> {:>9.2f} ms for {:.1f}x the input: exponent {:.2f}, {}\n",
+                                     largest.stage, smallest.bestWall * 1000, largest.bestWall * 1000,
+                                     static_cast<double>(largest.inputBytes) / smallest.inputBytes, exponent,
+                                     verdict);
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    CLI::App app{"SubChat benchmark on synthetic chats"};
+
+    SyntheticChatOptions options;
+    std::vector<size_t> sizes = {10000, 1000000};
+    std::filesystem::path configPath, jsonPath, generatePath, inputPath, baselinePath;
+    std::string timeUnit = "ms";
+    double tolerance = 0.2;
+    bool assertNoAlloc = false, complexity = false;
+    double maxExponent = 1.5;
+    size_t repeat = 3;
+    int videoWidth = 1920, videoHeight = 1080;
+
+    app.add_option("--sizes", sizes, "Chat sizes in messages, comma separated (default: 10000,1000000)")
+            ->delimiter(',');
+    app.add_option("-c,--config", configPath, "Config file to convert with (default: built-in defaults)")
+            ->check(CLI::ExistingFile);
+    app.add_option("-r,--repeat", repeat, "Runs of every benchmark, the best and median are reported (default: 3)")
+            ->check(CLI::PositiveNumber);
+    app.add_option("--json", jsonPath, "Write the results as JSON to this file (- for stdout)");
+    app.add_option("--width", videoWidth, "Video width for ASS output");
+    app.add_option("--height", videoHeight, "Video height for ASS output");
+    app.add_option("-i,--input", inputPath, "Benchmark this chat CSV instead of synthetic chats")
+            ->check(CLI::ExistingFile);
+    app.add_option("-u,--time-unit", timeUnit, "Time unit inside the --input CSV: “ms” or “sec” (default: ms)")
+            ->check(CLI::IsMember({"ms", "sec"}, CLI::ignore_case));
+    app.add_option("--baseline", baselinePath,
+                   "Compare with the --json results of an earlier run; exit with 1 when an output changed or a "
+                   "benchmark got slower than --tolerance allows")
+            ->check(CLI::ExistingFile);
+    app.add_option("--tolerance", tolerance,
+                   "With --baseline: how much slower a benchmark may get, 0.2 = 20% (default: 0.2)")
+            ->check(CLI::NonNegativeNumber);
+    app.add_flag("--assert-no-alloc", assertNoAlloc,
+                 "Exit with 1 when the per-batch loop of the SRV3 or ASS output allocates per message, i.e. more "
+                 "than 8 times per window line");
+    app.add_flag("--complexity", complexity,
+                  "Instead of synthetic chats, run adversarial inputs (huge words, long usernames of combining "
+                  "marks, one timestamp for everything, ...) at growing sizes and exit with 1 when a stage's time "
+                  "grows faster than the input");
+    app.add_option("--max-exponent", maxExponent,
+                   "With --complexity: how fast a stage's time may grow with the input size, as the exponent of "
+                   "a power law; 1 is linear, 2 quadratic (default: 1.5)")
+            ->check(CLI::PositiveNumber);
+    app.add_option("--generate", generatePath,
+                   "Only write a synthetic chat CSV (times in ms) of the first --sizes messages to this file");
+
+    app.add_option("--seed", options.seed, "Seed of the synthetic chat (default: 1)");
+    app.add_option("--rate", options.rate, "Average messages per second outside of bursts (default: 10)")
+            ->check(CLI::PositiveNumber);
+    app.add_option("--users", options.users, "Distinct users (default: 5000)")->check(CLI::PositiveNumber);
+    app.add_option("--mean-words", options.meanWords, "Average words per message (default: 6)")
+            ->check(CLI::PositiveNumber);
+    app.add_option("--max-words", options.maxWords, "Most words in a message (default: 60)")
+            ->check(CLI::PositiveNumber);
+    app.add_option("--unicode", options.unicodeRatio,
+                   "Share of non-ASCII words: Cyrillic, CJK, RTL, emoji, combining marks (default: 0.1)")
+            ->check(CLI::Range(0.0, 1.0));
+    app.add_option("--duplicates", options.duplicateRatio,
+                   "Share of messages repeating a recent one, like spam and copypasta (default: 0.05)")
+            ->check(CLI::Range(0.0, 1.0));
+    app.add_option("--burst-every", options.burstEvery, "Seconds between bursts, 0 for none (default: 300)")
+            ->check(CLI::NonNegativeNumber);
+    app.add_option("--burst-length", options.burstLength, "Seconds a burst lasts (default: 20)")
+            ->check(CLI::NonNegativeNumber);
+    app.add_option("--burst-factor", options.burstFactor, "Rate multiplier during bursts (default: 10)")
+            ->check(CLI::PositiveNumber);
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (sizes.empty() && inputPath.empty() && !complexity) {
+        std::cerr << "Error: --sizes needs at least one size\n";
+        return 1;
+    }
+
+    if (!generatePath.empty()) {
+        std::ofstream out(generatePath);
+        writeChatCsv(out, SyntheticChat(options).take(sizes.front()));
+        if (!out) {
+            std::cerr << "Error: Cannot write " << generatePath << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    ChatParams params;
+    if (!configPath.empty() && !params.loadFromFile(configPath.c_str())) {
+        std::cerr << "Error: Cannot open config file " << configPath << "\n";
+        return 1;
+    }
+
+    // Everything the results depend on besides the code and the machine.
+    std::string setup = std::format("\"config\":\"{}\",\"width\":{},\"height\":{},",
+                                    configPath.empty() ? "default" : fileDigest(configPath), videoWidth, videoHeight);
+    if (complexity) {
+        setup += "\"complexity\":true";
+    } else if (inputPath.empty()) {
+        setup += std::format("\"seed\":{},\"rate\":{},\"users\":{},\"mean_words\":{},\"max_words\":{},"
+                             "\"unicode_ratio\":{},\"duplicate_ratio\":{},\"burst_every\":{},\"burst_length\":{},"
+                             "\"burst_factor\":{}",
+                             options.seed, options.rate, options.users, options.meanWords, options.maxWords,
+                             options.unicodeRatio, options.duplicateRatio, options.burstEvery, options.burstLength,
+                             options.burstFactor);
+    } else {
+        setup += std::format("\"input\":\"{}\"", fileDigest(inputPath));
+    }
+
+    if (complexity && !baselinePath.empty()) {
+        std::cerr << "Error: --complexity judges growth on its own, it cannot be compared with --baseline\n";
+        return 1;
+    }
+    std::map<std::pair<std::string, size_t>, BaselineResult> baseline;
+    if (!baselinePath.empty()) {
+        try {
+            baseline = readBaseline(baselinePath, setup);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    std::cout << std::format("{:<11} {:>9} {:>10} {:>10} {:>10} {:>12} {:>9} {:>11} {:>9}\n", "stage", "messages",
+                             "best ms", "median ms", "cpu ms", "messages/s", "MB/s", "allocs/msg", "B/msg");
+    size_t complexityFailures = 0;
+    if (complexity) {
+        complexityFailures = runComplexity(params, repeat, videoWidth, videoHeight, maxExponent, results);
+    } else if (inputPath.empty()) {
+        for (size_t size: sizes) {
+            std::ostringstream csv;
+            writeChatCsv(csv, SyntheticChat(options).take(size));
+            benchChat(std::move(csv).str(), 1, params, repeat, videoWidth, videoHeight, results);
+        }
+    } else {
+        std::ifstream in(inputPath, std::ios::binary);
+        std::string csv{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+        try {
+            benchChat(csv, timeUnit == "sec" ? 1000 : 1, params, repeat, videoWidth, videoHeight, results);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    std::cout << std::format("Peak RSS: {:.1f} MB\n", peakRssBytes() / 1e6);
+
+    if (jsonPath == "-") {
+        writeJson(std::cout, setup, results);
+    } else if (!jsonPath.empty()) {
+        std::ofstream json(jsonPath);
+        writeJson(json, setup, results);
+        if (!json) {
+            std::cerr << "Error: Cannot write " << jsonPath << "\n";
+            return 1;
+        }
+    }
+
+    int result = 0;
+    if (complexityFailures) {
+        std::cerr << "Error: " << complexityFailures << " stage(s) grow faster than the input\n";
+        result = 1;
+    }
+    if (assertNoAlloc) {
+        // Buffers kept per window slot may still grow to the longest line they hold.
+        const uint64_t allowance = 8 * static_cast<uint64_t>(std::max(params.totalDisplayLines, 1));
+        for (const auto &bench: results) {
+            if (bench.loopAllocations <= allowance) continue;
+            std::cerr << std::format("Error: {} batch loop allocated {} times for {} messages (allowed: {})\n",
+                                     bench.stage, bench.loopAllocations, bench.messages, allowance);
+            result = 1;
+        }
+    }
+
+    if (!baselinePath.empty()) {
+        std::cout << "\n";
+        if (size_t failures = compareBaseline(results, baseline, tolerance)) {
+            std::cerr << "Error: " << failures << " benchmark(s) regressed against " << baselinePath << "\n";
+            result = 1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "subtitle_writers.h"
+#include "thread_pool.h"
+
+// Workload report of --analyze: how busy a chat is and how it wraps at a range of widths, to pick
+// layout parameters before writing anything. The chat is split into chunks that are reduced on
+// a thread pool and merged.
+
+// Messages in every second (or minute) from the first busy one to the last.
+struct RateHistogram {
+    uint64_t start = 0; // first second (minute) of counts
+    std::vector<uint32_t> counts;
+
+    void add(uint64_t slot, uint32_t messages = 1) {
+        if (counts.empty()) start = slot;
+        if (slot < start) {
+            counts.insert(counts.begin(), start - slot, 0);
+            start = slot;
+        }
+        if (slot - start >= counts.size()) counts.resize(slot - start + 1, 0);
+        counts[slot - start] += messages;
+    }
+
+    void merge(const RateHistogram &other) {
+        for (size_t i = 0; i < other.counts.size(); ++i) {
+            if (other.counts[i]) add(other.start + i, other.counts[i]);
+        }
+    }
+
+    // The same chat counted in slots factor times as long.
+    RateHistogram coarser(uint64_t factor) const {
+        RateHistogram result;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (counts[i]) result.add((start + i) / factor, counts[i]);
+        }
+        return result;
+    }
+};
+
+// How many messages wrap into how many lines at one width.
+struct LineDistribution {
+    int width = 0;
+    std::vector<uint64_t> messages; // messages[n]: messages taking n lines
+
+    void add(size_t lines) {
+        if (lines >= messages.size()) messages.resize(lines + 1, 0);
+        messages[lines]++;
+    }
+
+    // Smallest line count that at least share of the messages do not exceed.
+    size_t percentile(double share) const {
+        uint64_t total = 0;
+        for (auto count: messages) total += count;
+        uint64_t seen = 0;
+        for (size_t lines = 0; lines < messages.size(); ++lines) {
+            seen += messages[lines];
+            if (seen && static_cast<double>(seen) >= share * static_cast<double>(total)) return lines;
+        }
+        return 0;
+    }
+};
+
+struct ChatAnalysis {
+    size_t messages = 0;
+    size_t users = 0;
+    size_t colors = 0;
+    size_t duplicates = 0;     // messages repeating the text of another one
+    uint64_t textBytes = 0;
+    RateHistogram perSecond;
+    std::vector<LineDistribution> lines;
+    // Batches left after frame coalescing (coalesceBatches) at a few intervals in ms. Interval 0
+    // is what the batcher does on its own: one batch per timestamp.
+    std::vector<std::pair<int, size_t> > coalesced;
+};
+
+// Everything one chunk of the chat contributes; the string views point into the chat.
+struct ChatAnalysisPart {
+    size_t messages = 0;
+    uint64_t textBytes = 0;
+    RateHistogram perSecond;
+    std::vector<LineDistribution> lines;
+    std::unordered_set<std::string_view> users;
+    std::set<Color> colors;
+    std::vector<size_t> textHashes; // sorted, without repeats
+    size_t chunkDuplicates = 0;     // repeats within the chunk
+};
+
+inline ChatAnalysisPart analyzeChunk(const ChatMessage *begin, const ChatMessage *end, const std::vector<int> &widths,
+                                     const std::string &usernameSeparator) {
+    TraceScope trace("analyze chunk", end - begin);
+    ChatAnalysisPart part;
+    part.messages = static_cast<size_t>(end - begin);
+    for (int width: widths) part.lines.push_back({width, {}});
+    part.textHashes.reserve(part.messages);
+    std::hash<std::string_view> hash;
+    for (const ChatMessage *message = begin; message != end; ++message) {
+        part.textBytes += message->message.size();
+        part.perSecond.add(message->time / 1000);
+        part.users.insert(message->user.name);
+        part.colors.insert(message->user.color);
+        part.textHashes.push_back(hash(message->message));
+        for (auto &distribution: part.lines) {
+            distribution.add(wrapMessage(message->user.name, usernameSeparator, message->message,
+                                         distribution.width).second.size());
+        }
+    }
+    std::ranges::sort(part.textHashes);
+    auto repeats = std::ranges::unique(part.textHashes);
+    part.chunkDuplicates = static_cast<size_t>(repeats.size());
+    part.textHashes.erase(repeats.begin(), repeats.end());
+    return part;
+}
+
+// Batches of the chat after coalesceBatches(interval), counted without making them.
+inline size_t countCoalescedBatches(const std::vector<ChatMessage> &chat, int interval) {
+    size_t batches = 0;
+    uint64_t batchTime = 0;
+    for (const auto &message: chat) {
+        if (batches && message.time == batchTime) continue;
+        if (batches && message.time > batchTime && message.time - batchTime < static_cast<uint64_t>(interval)) {
+            continue;
+        }
+        batches++;
+        batchTime = message.time;
+    }
+    return batches;
+}
+
+// widths are the maxCharsPerLine values to wrap at; messages are wrapped the way a config with
+// usernameSeparator would. Hashing stands in for comparing texts, so the duplicate count may be
+// off by the (rare) collisions.
+inline ChatAnalysis analyzeChat(const std::vector<ChatMessage> &chat, const std::vector<int> &widths,
+                                const std::string &usernameSeparator, ThreadPool &pool) {
+    TraceScope trace("analyzeChat", static_cast<int64_t>(chat.size()));
+    const size_t chunkSize = std::max<size_t>(4096, chat.size() / (pool.size() * 4) + 1);
+    std::vector<ChatAnalysisPart> parts((chat.size() + chunkSize - 1) / chunkSize);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        pool.submit([&, i] {
+            const ChatMessage *begin = chat.data() + i * chunkSize;
+            parts[i] = analyzeChunk(begin, begin + std::min(chunkSize, chat.size() - i * chunkSize), widths,
+                                    usernameSeparator);
+        });
+    }
+    ChatAnalysis analysis;
+    analysis.coalesced = {{0, 0}, {100, 0}, {250, 0}, {500, 0}, {1000, 0}, {2000, 0}};
+    for (auto &[interval, batches]: analysis.coalesced) batches = countCoalescedBatches(chat, interval);
+    pool.wait();
+
+    TraceScope traceMerge("merge analysis");
+    std::unordered_set<std::string_view> users;
+    std::set<Color> colors;
+    std::vector<size_t> textHashes;
+    for (int width: widths) analysis.lines.push_back({width, {}});
+    for (auto &part: parts) {
+        analysis.messages += part.messages;
+        analysis.textBytes += part.textBytes;
+        analysis.perSecond.merge(part.perSecond);
+        for (size_t i = 0; i < part.lines.size(); ++i) {
+            auto &total = analysis.lines[i].messages;
+            const auto &counts = part.lines[i].messages;
+            if (counts.size() > total.size()) total.resize(counts.size(), 0);
+            for (size_t lines = 0; lines < counts.size(); ++lines) total[lines] += counts[lines];
+        }
+        users.merge(part.users);
+        colors.merge(part.colors);
+        analysis.duplicates += part.chunkDuplicates;
+        textHashes.insert(textHashes.end(), part.textHashes.begin(), part.textHashes.end());
+    }
+    std::ranges::sort(textHashes);
+    analysis.duplicates += static_cast<size_t>(std::ranges::unique(textHashes).size());
+    analysis.users = users.size();
+    analysis.colors = colors.size();
+    return analysis;
+}
+
+// What a config would turn the chat into, found by running the whole pipeline with a writer that
+// only counts. userColors are the distinct username colors of the chat.
+struct OutputPrediction {
+    size_t batches = 0;
+    SubtitleStats stats;
+};
+
+inline OutputPrediction predictOutput(const std::vector<ChatMessage> &chat, const ChatParams &params,
+                                      const std::vector<Color> &userColors) {
+    TraceScope trace("predictOutput", static_cast<int64_t>(chat.size()));
+    DiscardBuffer discard;
+    std::ostream sink(&discard);
+    BufferedWriter writer(&sink);
+    Srv3Emitter emitter(params);
+    ChatBatcher batcher(params.totalDisplayLines);
+    OutputPrediction prediction;
+    std::optional<Batch> pending;
+    emitter.begin(writer, userColors);
+    for (const auto &message: chat) {
+        WrappedMessage wrapped = wrapChatMessage(message, params);
+        if (wrapped.lines.empty()) continue;
+        if (const Batch *batch = batcher.push(wrapped)) {
+            prediction.batches++;
+            if (pending) emitter.batch(writer, *pending, batch->time);
+            pending = *batch;
+        }
+    }
+    emitter.end(writer);
+    prediction.stats.distinctColors = userColors.size();
+    prediction.stats.pens = emitter.paletteSize();
+    prediction.stats.events = emitter.events();
+    prediction.stats.bytes = writer.size();
+    return prediction;
+}
+
+// The distinct username colors predictOutput() expects.
+inline std::vector<Color> chatUserColors(const std::vector<ChatMessage> &chat) {
+    std::set<Color> colors;
+    for (const auto &message: chat) colors.insert(message.user.color);
+    return {colors.begin(), colors.end()};
+}
+
+// Seconds (minutes) grouped by how many messages they had: none, 1, 2-3, 4-7, ... Empty groups are left out.
+inline void printRates(std::ostream &out, const RateHistogram &rates, std::string_view unit, uint64_t slotSeconds) {
+    if (rates.counts.empty()) return;
+    std::vector<uint32_t> sorted = rates.counts;
+    std::ranges::sort(sorted);
+    auto at = [&](double share) {
+        return sorted[std::min(sorted.size() - 1, static_cast<size_t>(share * static_cast<double>(sorted.size())))];
+    };
+    uint64_t total = 0;
+    for (auto count: sorted) total += count;
+    auto peak = std::ranges::max_element(rates.counts);
+    uint64_t peakSecond = (rates.start + static_cast<uint64_t>(peak - rates.counts.begin())) * slotSeconds;
+    out << std::format("Messages per {}: mean {:.2f}, p50 {}, p90 {}, p99 {}, max {} at {}:{:02}:{:02}\n", unit,
+                       static_cast<double>(total) / static_cast<double>(sorted.size()), at(0.5), at(0.9), at(0.99),
+                       *peak, peakSecond / 3600, peakSecond / 60 % 60, peakSecond % 60);
+    std::vector<size_t> buckets;
+    for (auto count: rates.counts) {
+        size_t bucket = count ? std::bit_width(count) : 0;
+        if (bucket >= buckets.size()) buckets.resize(bucket + 1, 0);
+        buckets[bucket]++;
+    }
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        if (!buckets[bucket]) continue;
+        std::string range = bucket <= 1 ? std::to_string(bucket)
+                                        : std::format("{}-{}", 1u << (bucket - 1), (1u << bucket) - 1);
+        double share = static_cast<double>(buckets[bucket]) / static_cast<double>(rates.counts.size());
+        out << std::format("  {:>11} {:>8} {:>6.2f}% {}\n", range, buckets[bucket], share * 100,
+                           std::string(static_cast<size_t>(share * 40 + 0.5), '#'));
+    }
+}
+
+inline void printAnalysis(std::ostream &out, const ChatAnalysis &analysis) {
+    out << std::format("Messages: {}, users: {}, username colors: {}, text: {:.2f} MB\n", analysis.messages,
+                       analysis.users, analysis.colors, static_cast<double>(analysis.textBytes) / 1e6);
+    if (!analysis.messages) return;
+    out << std::format("Duplicates: {} ({:.2f}% of the messages repeat an earlier text)\n", analysis.duplicates,
+                       100.0 * static_cast<double>(analysis.duplicates) / static_cast<double>(analysis.messages));
+    const auto &seconds = analysis.perSecond;
+    out << std::format("Span: {} s from {} s\n", seconds.counts.size(), seconds.start);
+    printRates(out, seconds, "second", 1);
+    printRates(out, seconds.coarser(60), "minute", 60);
+
+    out << "Lines per message:\n";
+    out << std::format("  {:>5} {:>6} {:>4} {:>4} {:>4} {:>4} {:>7} {:>7} {:>7} {:>7}\n", "width", "mean", "p50",
+                       "p90", "p99", "max", "1", "2", "3", "4+");
+    for (const auto &distribution: analysis.lines) {
+        uint64_t lines = 0;
+        std::array<uint64_t, 4> shares{};
+        for (size_t n = 0; n < distribution.messages.size(); ++n) {
+            lines += n * distribution.messages[n];
+            if (n) shares[std::min<size_t>(n, 4) - 1] += distribution.messages[n];
+        }
+        auto percent = [&](uint64_t count) {
+            return std::format("{:.1f}%", 100.0 * static_cast<double>(count) / static_cast<double>(analysis.messages));
+        };
+        out << std::format("  {:>5} {:>6.2f} {:>4} {:>4} {:>4} {:>4} {:>7} {:>7} {:>7} {:>7}\n", distribution.width,
+                           static_cast<double>(lines) / static_cast<double>(analysis.messages),
+                           distribution.percentile(0.5), distribution.percentile(0.9), distribution.percentile(0.99),
+                           distribution.messages.size() - 1, percent(shares[0]), percent(shares[1]),
+                           percent(shares[2]), percent(shares[3]));
+    }
+
+    out << "Batches when timestamps closer than the interval share one:\n";
+    for (const auto &[interval, batches]: analysis.coalesced) {
+        out << std::format("  {:>5} ms {:>10}\n", interval, batches);
+    }
+}
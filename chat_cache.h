@@ -0,0 +1,184 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "ytt_generator.h"
+#include "pipeline_stats.h"
+
+// Parsed chats, their wrapped and batched forms, and loaded configs, shared between conversions.
+// A value several threads ask for at once is computed once, the others wait for it. When the
+// estimated size of the cached values exceeds the limit, the least recently used ones are dropped
+// (values still in use stay alive until their last user lets go). A limit of 0 means no limit.
+class ChatCache {
+public:
+    using Chat = std::vector<ChatMessage>;
+    using Wrapped = std::vector<WrappedMessage>;
+    using Batches = std::vector<Batch>;
+
+    explicit ChatCache(uint64_t limit = 0) : limit(limit) {
+    }
+
+    ChatCache(const ChatCache &) = delete;
+
+    ChatCache &operator=(const ChatCache &) = delete;
+
+    // chatKey names the chat and must change when its content does; load() reads it on a miss.
+    // With stats, the work done on a miss is measured and counted.
+    std::shared_ptr<const Chat> chat(const std::string &chatKey, const std::function<Chat()> &load,
+                                     PipelineStats *stats = nullptr) {
+        return get<Chat>("chat\n" + chatKey, [&] {
+            auto chat = std::make_shared<Chat>(timeStage(stats, Stage::Parse, load));
+            if (stats) stats->messages += chat->size();
+            uint64_t bytes = chat->capacity() * sizeof(ChatMessage);
+            for (const auto &message: *chat) bytes += message.user.name.capacity() + message.message.capacity();
+            return std::make_pair(std::shared_ptr<const Chat>(std::move(chat)), bytes);
+        });
+    }
+
+    // Wrapping only depends on maxCharsPerLine and usernameSeparator.
+    std::shared_ptr<const Wrapped> wrapped(const std::string &chatKey, const Chat &chat, const ChatParams &params,
+                                           PipelineStats *stats = nullptr) {
+        return get<Wrapped>(wrapKey(chatKey, params), [&] {
+            auto wrapped = std::make_shared<Wrapped>(
+                timeStage(stats, Stage::Wrap, [&] { return wrapMessages(chat, params); }));
+            if (stats) {
+                for (const auto &message: *wrapped) stats->lines += message.lines.size();
+            }
+            uint64_t bytes = wrapped->capacity() * sizeof(WrappedMessage);
+            for (const auto &message: *wrapped) bytes += linesSize(message.lines);
+            return std::make_pair(std::shared_ptr<const Wrapped>(std::move(wrapped)), bytes);
+        });
+    }
+
+    // Batches additionally depend on totalDisplayLines.
+    std::shared_ptr<const Batches> batches(const std::string &chatKey, const Chat &chat, const ChatParams &params,
+                                           PipelineStats *stats = nullptr) {
+        return get<Batches>(wrapKey(chatKey, params) + "\n" + std::to_string(params.totalDisplayLines), [&] {
+            auto source = wrapped(chatKey, chat, params, stats);
+            auto batches = std::make_shared<Batches>(timeStage(stats, Stage::Batch, [&] {
+                return generateBatches(*source, params.totalDisplayLines);
+            }));
+            if (stats) stats->batches += batches->size();
+            uint64_t bytes = batches->capacity() * sizeof(Batch);
+            for (const auto &batch: *batches) bytes += linesSize(batch.lines);
+            return std::make_pair(std::shared_ptr<const Batches>(std::move(batches)), bytes);
+        });
+    }
+
+    // A config file, loaded again when it changed on disk. Throws std::runtime_error when it cannot be read.
+    ChatParams config(const std::filesystem::path &path) {
+        std::error_code ec;
+        auto modified = std::filesystem::last_write_time(path, ec);
+        auto key = "config\n" + path.string() + "\n" + std::to_string(modified.time_since_epoch().count());
+        return *get<ChatParams>(key, [&] {
+            auto params = std::make_shared<ChatParams>();
+            if (ec || !params->loadFromFile(path.c_str())) {
+                throw std::runtime_error("Cannot open config file " + path.string());
+            }
+            return std::make_pair(std::shared_ptr<const ChatParams>(std::move(params)), uint64_t(sizeof(ChatParams)));
+        });
+    }
+
+    // Key of a chat file that changes whenever the file is rewritten.
+    static std::string fileKey(const std::filesystem::path &path) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(path, ec);
+        auto modified = std::filesystem::last_write_time(path, ec);
+        return path.string() + "\n" + std::to_string(size) + "\n" + std::to_string(modified.time_since_epoch().count());
+    }
+
+    size_t hits() const {
+        std::lock_guard lock(mutex);
+        return hitCount;
+    }
+
+    size_t misses() const {
+        std::lock_guard lock(mutex);
+        return missCount;
+    }
+
+    uint64_t bytes() const {
+        std::lock_guard lock(mutex);
+        return used;
+    }
+
+private:
+    struct Entry {
+        std::shared_future<std::shared_ptr<const void> > value;
+        uint64_t bytes = 0; // 0 while the value is computed
+        std::list<std::string>::iterator recent;
+    };
+
+    static std::string wrapKey(const std::string &chatKey, const ChatParams &params) {
+        return "wrap\n" + chatKey + "\n" + std::to_string(params.maxCharsPerLine) + "\n" + params.usernameSeparator;
+    }
+
+    template<typename Lines>
+    static uint64_t linesSize(const Lines &lines) {
+        uint64_t bytes = lines.size() * sizeof(ChatLine);
+        for (const auto &line: lines) bytes += line.text.capacity() + (line.user ? line.user->name.capacity() : 0);
+        return bytes;
+    }
+
+    // make() returns the value and its estimated size. Its exceptions reach every waiting caller
+    // and nothing is cached.
+    template<typename T, typename Make>
+    std::shared_ptr<const T> get(const std::string &key, Make &&make) {
+        std::promise<std::shared_ptr<const void> > promise;
+        {
+            std::unique_lock lock(mutex);
+            if (auto it = entries.find(key); it != entries.end()) {
+                hitCount++;
+                recent.splice(recent.begin(), recent, it->second.recent);
+                auto value = it->second.value;
+                lock.unlock();
+                TraceScope trace("cache wait");
+                return std::static_pointer_cast<const T>(value.get());
+            }
+            missCount++;
+            recent.push_front(key);
+            entries.emplace(key, Entry{promise.get_future().share(), 0, recent.begin()});
+        }
+
+        try {
+            auto [value, bytes] = make();
+            promise.set_value(value);
+            std::lock_guard lock(mutex);
+            entries.at(key).bytes = std::max<uint64_t>(bytes, 1);
+            used += entries.at(key).bytes;
+            evict();
+            return value;
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            std::lock_guard lock(mutex);
+            recent.erase(entries.at(key).recent);
+            entries.erase(key);
+            throw;
+        }
+    }
+
+    // Called with mutex held. Values still being computed are skipped.
+    void evict() {
+        for (auto it = recent.end(); limit && used > limit && it != recent.begin();) {
+            --it;
+            auto entry = entries.find(*it);
+            if (entry->second.bytes == 0) continue;
+            used -= entry->second.bytes;
+            entries.erase(entry);
+            it = recent.erase(it);
+        }
+    }
+
+    uint64_t limit;
+    uint64_t used = 0;
+    size_t hitCount = 0;
+    size_t missCount = 0;
+    mutable std::mutex mutex;
+    std::list<std::string> recent; // most recently used first
+    std::unordered_map<std::string, Entry> entries;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "ytt_generator.h"
+
+// Reads a file that another process keeps appending to. Only complete lines are handed out, a
+// line still being written is kept until its newline arrives.
+// On Linux the file is watched with inotify, elsewhere its size is polled.
+class FileFollower {
+public:
+    explicit FileFollower(const std::filesystem::path &path) : path(path), file(path, std::ios::binary) {
+        if (!file.is_open()) throw std::runtime_error("Could not open file " + path.string());
+#if defined(__linux__)
+        watch = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (watch >= 0 && inotify_add_watch(watch, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            close(watch);
+            watch = -1;
+        }
+#endif
+    }
+
+    FileFollower(const FileFollower &) = delete;
+
+    FileFollower &operator=(const FileFollower &) = delete;
+
+    ~FileFollower() {
+#if defined(__linux__)
+        if (watch >= 0) close(watch);
+#endif
+    }
+
+    // Calls onLine(std::string_view) for every line completed since the last call, without its
+    // line break, and returns how many there were.
+    template<typename OnLine>
+    size_t read(OnLine &&onLine) {
+        char chunk[1 << 16];
+        size_t lines = 0;
+        while (true) {
+            file.clear();
+            file.read(chunk, sizeof(chunk));
+            std::streamsize count = file.gcount();
+            if (count <= 0) break;
+            offset += static_cast<uint64_t>(count);
+
+            size_t lineStart = 0;
+            std::string_view data(chunk, static_cast<size_t>(count));
+            for (size_t newline = data.find('\n'); newline != std::string_view::npos;
+                 newline = data.find('\n', lineStart)) {
+                partial.append(data.substr(lineStart, newline - lineStart));
+                lineStart = newline + 1;
+                if (!partial.empty() && partial.back() == '\r') partial.pop_back();
+                onLine(std::string_view(partial));
+                lines++;
+                partial.clear();
+            }
+            partial.append(data.substr(lineStart));
+        }
+        file.clear();
+        return lines;
+    }
+
+    // Blocks until the file may have grown or the timeout passed. Returns false on timeout;
+    // a signal can end the wait early.
+    bool wait(std::chrono::milliseconds timeout) {
+#if defined(__linux__)
+        if (watch >= 0) {
+            pollfd fd{watch, POLLIN, 0};
+            int ready = poll(&fd, 1, static_cast<int>(timeout.count()));
+            if (ready <= 0) return false;
+            char events[4096];
+            while (::read(watch, events, sizeof(events)) > 0) {
+            }
+            return true;
+        }
+#endif
+        auto until = std::chrono::steady_clock::now() + timeout;
+        while (std::chrono::steady_clock::now() < until) {
+            std::error_code ec;
+            if (std::filesystem::file_size(path, ec) > offset && !ec) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return false;
+    }
+
+    // A followed file never ends by itself.
+    bool closed() const {
+        return false;
+    }
+
+private:
+    std::filesystem::path path;
+    std::ifstream file;
+    uint64_t offset = 0;
+    std::string partial;
+#if defined(__linux__)
+    int watch = -1;
+#endif
+};
+
+// Chat CSV lines as they come in. The first line has to be the header.
+class CsvLineParser {
+public:
+    explicit CsvLineParser(int timeMultiplier) : timeMultiplier(timeMultiplier) {
+    }
+
+    // Returns false for lines that are not a message. Lines with a bad time are skipped and
+    // counted; a wrong header throws std::runtime_error.
+    bool parse(std::string_view line, ChatMessage &message) {
+        if (!headerSeen) {
+            if (!isCSVHeader(line)) throw std::runtime_error("Unexpected CSV header format");
+            headerSeen = true;
+            return false;
+        }
+        try {
+            message = parseCSVLine(line, timeMultiplier);
+            return true;
+        } catch (const std::invalid_argument &) {
+            skipped++;
+            return false;
+        }
+    }
+
+    size_t skippedLines() const {
+        return skipped;
+    }
+
+private:
+    int timeMultiplier;
+    bool headerSeen = false;
+    size_t skipped = 0;
+};
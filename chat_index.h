@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ytt_generator.h"
+
+// Sparse index of a chat CSV: the time, byte offset and line number of every stride-th message,
+// so a time range can be read without parsing what comes before it. It is saved next to the CSV
+// (chat.csv.idx) and rebuilt when the CSV's size or modification time changed. Times are the raw
+// CSV values, the index serves either time unit.
+class ChatIndex {
+public:
+    struct Entry {
+        int64_t time;        // raw time field
+        uint64_t offset;     // byte offset of the line
+        uint64_t lineNumber; // 1 is the header
+    };
+
+    static constexpr size_t stride = 4096;
+
+    // Throws std::runtime_error when the CSV cannot be read. Failing to save the index is not an
+    // error, it is only built again next time.
+    static ChatIndex open(const std::filesystem::path &csv) {
+        ChatIndex index;
+        index.key = fileKey(csv);
+        auto path = indexPath(csv);
+        if (index.load(path)) return index;
+        index.build(csv);
+        index.save(path);
+        return index;
+    }
+
+    static std::filesystem::path indexPath(const std::filesystem::path &csv) {
+        auto path = csv;
+        path += ".idx";
+        return path;
+    }
+
+    // False when a message is older than the one before it; the index cannot be used then.
+    bool sorted() const {
+        return inOrder;
+    }
+
+    // The entry to start reading at so that at least `before` messages older than `from` (raw
+    // time) are read, if the CSV has that many.
+    const Entry &seek(int64_t from, size_t before) const {
+        // Entries past the first one are never older than the messages before them.
+        auto after = std::ranges::lower_bound(entries, from, {}, &Entry::time);
+        size_t older = static_cast<size_t>(after - entries.begin());
+        size_t back = (before + stride - 1) / stride + 1;
+        return entries[older > back ? older - back : 0];
+    }
+
+private:
+    // Size and modification time, like ChatCache::fileKey.
+    static std::string fileKey(const std::filesystem::path &csv) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(csv, ec);
+        auto modified = std::filesystem::last_write_time(csv, ec);
+        return std::to_string(size) + " " + std::to_string(modified.time_since_epoch().count());
+    }
+
+    // The time field of a data line, nullopt when it is not a number.
+    static std::optional<int64_t> lineTime(std::string_view line) {
+        int64_t time = 0;
+        auto field = line.substr(0, line.find(','));
+        auto result = std::from_chars(field.data(), field.data() + field.size(), time);
+        if (result.ec != std::errc() || result.ptr != field.data() + field.size()) return std::nullopt;
+        return time;
+    }
+
+    void build(const std::filesystem::path &csv) {
+        TraceScope trace("build chat index");
+        std::ifstream file(csv, std::ios::binary);
+        if (!file.is_open()) throw std::runtime_error("Could not open file " + csv.string());
+        std::string line;
+        uint64_t offset = 0;
+        uint64_t lineNumber = 0;
+        size_t messages = 0;
+        int64_t last = std::numeric_limits<int64_t>::min();
+        // The header is entry 0, with the smallest time, so a range before every message starts there.
+        entries.push_back({last, 0, 1});
+        while (std::getline(file, line)) {
+            uint64_t lineOffset = offset;
+            offset += line.size() + 1;
+            if (++lineNumber == 1) continue;
+            auto time = lineTime(line);
+            if (!time) continue;
+            if (*time < last) inOrder = false;
+            last = *time;
+            if (messages++ % stride == 0) entries.push_back({*time, lineOffset, lineNumber});
+        }
+    }
+
+    bool load(const std::filesystem::path &path) {
+        std::ifstream file(path);
+        std::string header;
+        if (!std::getline(file, header) || header != "subchat-index 1 " + key) return false;
+        std::string order;
+        file >> order;
+        if (order != "sorted" && order != "unsorted") return false;
+        inOrder = order == "sorted";
+        Entry entry{};
+        while (file >> entry.time >> entry.offset >> entry.lineNumber) entries.push_back(entry);
+        if (!file.eof() || entries.empty()) {
+            entries.clear();
+            return false;
+        }
+        return true;
+    }
+
+    void save(const std::filesystem::path &path) const {
+        auto temporary = path;
+        temporary += ".tmp";
+        {
+            std::ofstream file(temporary);
+            file << "subchat-index 1 " << key << "\n" << (inOrder ? "sorted" : "unsorted") << "\n";
+            for (const auto &entry: entries) {
+                file << entry.time << " " << entry.offset << " " << entry.lineNumber << "\n";
+            }
+            if (!file) return;
+        }
+        std::error_code ec;
+        std::filesystem::rename(temporary, path, ec);
+        if (ec) std::filesystem::remove(temporary, ec);
+    }
+
+    std::string key;
+    bool inOrder = true;
+    std::vector<Entry> entries;
+};
+
+// The messages of [from, to) (ms), the `before` messages preceding the range, which fill the chat
+// window at its start, and the first message at or after `to`, which ends the last batch of the
+// range. The messages are expected in time order.
+template<typename Messages>
+auto chatRange(Messages &chat, uint64_t from, uint64_t to, size_t before) {
+    auto first = std::ranges::lower_bound(chat, from, {}, &ChatMessage::time);
+    auto last = std::ranges::lower_bound(first, chat.end(), to, {}, &ChatMessage::time);
+    if (last != chat.end()) ++last;
+    first -= std::min<ptrdiff_t>(first - chat.begin(), static_cast<ptrdiff_t>(before));
+    return std::ranges::subrange(first, last);
+}
+
+// Keeps only the chatRange() of chat.
+inline std::vector<ChatMessage> trimChat(std::vector<ChatMessage> chat, uint64_t from, uint64_t to, size_t before) {
+    auto range = chatRange(chat, from, to, before);
+    chat.erase(range.end(), chat.end());
+    chat.erase(chat.begin(), range.begin());
+    return chat;
+}
+
+// trimChat() of a chat CSV, reading only about the range through the file's ChatIndex. A CSV
+// that is not in time order is read whole and trimmed as it is, like chats without an index.
+// Throws std::runtime_error like parseCSV.
+inline std::vector<ChatMessage> parseCSVRange(const std::filesystem::path &filename, int timeMultiplier,
+                                              uint64_t from, uint64_t to, size_t before) {
+    TraceScope trace("parseCSVRange");
+    ChatIndex index = ChatIndex::open(filename);
+    if (!index.sorted()) return trimChat(parseCSV(filename, timeMultiplier), from, to, before);
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) throw std::runtime_error("Could not open file " + filename.string());
+    std::string line;
+    std::getline(file, line);
+    if (!isCSVHeader(line)) throw std::runtime_error("Unexpected CSV header format in " + filename.string());
+
+    const auto &start = index.seek(static_cast<int64_t>(from / static_cast<uint64_t>(timeMultiplier)), before);
+    if (start.offset) file.seekg(static_cast<std::streamoff>(start.offset));
+    std::vector<ChatMessage> messages;
+    uint64_t lineNumber = start.offset ? start.lineNumber - 1 : 1;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        try {
+            messages.emplace_back(parseCSVLine(line, timeMultiplier));
+        } catch (const std::invalid_argument &e) {
+            throw std::runtime_error(std::string(e.what()) + " on line " + std::to_string(lineNumber) +
+                                     " of " + filename.string());
+        }
+        if (messages.back().time >= to) break;
+    }
+    return trimChat(std::move(messages), from, to, before);
+}
@@ -6,54 +6,994 @@
 #endif
 
 #include "ytt_generator.h"
+#include "subtitle_writers.h"
+#include "thread_pool.h"
+#include "live_output.h"
+#include "overlay_server.h"
+#include "chat_follow.h"
+#include "irc_input.h"
+#include "chat_cache.h"
+#include "pipeline_stats.h"
+#include "conversion_daemon.h"
+#include "chat_analysis.h"
+#include "output_budget.h"
+#include "chat_index.h"
 #include <CLI/CLI.hpp>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <csignal>
+#include <cmath>
+#include <limits>
+#include <optional>
+
+// One output of a conversion.
+struct OutputJob {
+    std::filesystem::path outputPath;
+    ChatParams params;
+    std::shared_ptr<const std::vector<Batch> > batches;
+    SubtitleStats stats;
+    std::string_view paletteName;
+    std::string budgetSteps; // with a budget: what was done to meet it
+    std::filesystem::path shardOf; // --shard: the output this is a part of
+    uint64_t partFrom = 0;         // and the part's time range in ms
+    uint64_t partTo = 0;
+    std::string error;
+};
+
+// Everything made from one chat file: it is parsed once, then wrapped and batched once per
+// distinct layout of its outputs.
+struct Conversion {
+    std::filesystem::path inputPath;
+    bool irc = false;        // raw IRC log instead of CSV
+    int timeMultiplier = 1;  // CSV only
+    std::optional<uint64_t> ircStartTime;
+    std::optional<std::string> inlineData; // the chat itself instead of inputPath (daemon requests)
+    PipelineStats *stats = nullptr;        // --stats
+    const OutputBudget *budget = nullptr;  // --max-bytes, --max-events
+    std::optional<uint64_t> clipFrom;      // --from, ms
+    std::optional<uint64_t> clipTo;        // --to, ms
+    std::optional<uint64_t> shardLength;   // --shard, ms
+    size_t jobs = 1;                       // threads writing --shard parts
+    std::vector<OutputJob> outputs;
+    std::string error; // the chat could not be read, no output was written
+    double seconds = 0;
+};
+
+// --input-format: "csv", "irc", or "auto", which takes .log and .irc files for raw IRC logs.
+static bool isIrcInput(const std::filesystem::path &input, const std::string &format) {
+    if (format != "auto") return format == "irc";
+    std::string extension = input.extension().string();
+    std::ranges::transform(extension, extension.begin(), ::tolower);
+    return extension == ".log" || extension == ".irc";
+}
+
+// Subtitle times are int ms (Batch::time), which ends after 24.8 days.
+constexpr uint64_t maxSubtitleTime = std::numeric_limits<int>::max();
+
+// h:mm:ss.mmm, which parseClipTime reads back.
+static std::string formatClipTime(uint64_t ms) {
+    return std::format("{}:{:02}:{:02}.{:03}", ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+}
+
+// --from/--to: seconds, m:ss or h:mm:ss, each with optional fractions ("1:02:03.5"), in ms.
+// Minutes and seconds after a colon are below 60. Throws std::invalid_argument for anything else
+// and for times past maxSubtitleTime.
+static uint64_t parseClipTime(const std::string &text) {
+    double seconds = 0;
+    size_t start = 0;
+    for (int part = 0; part < 3; ++part) {
+        size_t colon = text.find(':', start);
+        std::string field = text.substr(start, colon == std::string::npos ? std::string::npos : colon - start);
+        size_t used = 0;
+        double value = -1;
+        try {
+            value = std::stod(field, &used);
+        } catch (const std::logic_error &) {
+        }
+        if (field.empty() || used != field.size() || !std::isfinite(value) || value < 0 ||
+            (colon != std::string::npos && value != std::floor(value)) || (part > 0 && value >= 60)) {
+            break;
+        }
+        seconds = seconds * 60 + value;
+        if (colon == std::string::npos) {
+            if (seconds * 1000 > static_cast<double>(maxSubtitleTime)) {
+                throw std::invalid_argument("Time \"" + text + "\" is past " + formatClipTime(maxSubtitleTime) +
+                                            ", the latest time subtitles can have");
+            }
+            return static_cast<uint64_t>(std::llround(seconds * 1000));
+        }
+        start = colon + 1;
+    }
+    throw std::invalid_argument("Invalid time \"" + text + "\", expected seconds, m:ss or h:mm:ss");
+}
+
+// Messages wrap into at least one line each, so a clip needs this many messages before its start
+// to fill every output's window.
+static size_t clipWarmMessages(const Conversion &conversion) {
+    size_t lines = 0;
+    for (const auto &job: conversion.outputs) lines = std::max<size_t>(lines, std::max(job.params.totalDisplayLines, 0));
+    return lines;
+}
+
+static std::vector<ChatMessage> readChat(const Conversion &conversion) {
+    if (conversion.clipFrom || conversion.clipTo) {
+        uint64_t from = conversion.clipFrom.value_or(0);
+        uint64_t to = conversion.clipTo.value_or(std::numeric_limits<uint64_t>::max());
+        if (!conversion.irc && !conversion.inlineData) {
+            return parseCSVRange(conversion.inputPath, conversion.timeMultiplier, from, to,
+                                 clipWarmMessages(conversion));
+        }
+        Conversion whole = conversion;
+        whole.clipFrom = whole.clipTo = std::nullopt;
+        return trimChat(readChat(whole), from, to, clipWarmMessages(conversion));
+    }
+    if (conversion.inlineData) {
+        std::istringstream data(*conversion.inlineData);
+        if (conversion.irc) return parseIrcLog(data, conversion.ircStartTime);
+        return parseCSV(data, conversion.timeMultiplier, "request data");
+    }
+    if (conversion.irc) return parseIrcLog(conversion.inputPath, conversion.ircStartTime);
+    return parseCSV(conversion.inputPath, conversion.timeMultiplier);
+}
+
+// Names the parsed chat of a conversion in a ChatCache.
+static std::string chatKey(const Conversion &conversion) {
+    std::string clip;
+    if (conversion.clipFrom || conversion.clipTo) {
+        clip = std::format("\nclip {} {} {}", conversion.clipFrom.value_or(0), conversion.clipTo.value_or(0),
+                           clipWarmMessages(conversion));
+    }
+    return (conversion.irc ? "irc " + std::to_string(conversion.ircStartTime.value_or(0))
+                           : "csv " + std::to_string(conversion.timeMultiplier)) +
+           "\n" + ChatCache::fileKey(conversion.inputPath) + clip;
+}
+
+// Serializes one output. Jobs only share the (read-only) batches, so each can run on its own thread.
+// With stats, the time spent in the stream is the write stage and the rest the serialize stage, which
+// includes measuring the output for a budget. An output that cannot be made to fit is not written.
+static void writeOutput(OutputJob &job, int videoWidth, int videoHeight, PipelineStats *stats,
+                        const OutputBudget *budget) {
+    TraceScope trace("writeOutput");
+    try {
+        std::optional<StageClock> clock;
+        StageTime writeTime;
+        if (stats) clock.emplace();
+        if (budget && budget->limited()) {
+            auto fit = fitBudget(job.batches, job.params, *budget, [&](const ChatParams &params) {
+                return makeEmitter(job.outputPath, params, videoWidth, videoHeight);
+            });
+            if (!fit.fits) {
+                job.error = std::format("Over budget: {} events, {} bytes as configured, {} events, {} bytes "
+                                        "at the smallest ({})", fit.configured.events, fit.configured.bytes,
+                                        fit.predicted.events, fit.predicted.bytes, fit.describe(job.params));
+                return;
+            }
+            job.budgetSteps = fit.describe(job.params);
+            if (fit.params.compactOutput != job.params.compactOutput || fit.coalesceInterval ||
+                fit.params.maxPens != job.params.maxPens) {
+                job.budgetSteps += std::format(", was {} events, {} bytes", fit.configured.events,
+                                               fit.configured.bytes);
+            }
+            job.params = fit.params;
+            job.batches = fit.batches;
+        }
+        std::ofstream out(job.outputPath);
+        if (!out) {
+            job.error = "Cannot open output file";
+            return;
+        }
+        auto emitter = makeEmitter(job.outputPath, job.params, videoWidth, videoHeight);
+        BufferedWriter writer(&out);
+        if (stats) writer.timeFlushes(&writeTime);
+        writeSubtitles(*emitter, writer, *job.batches, &job.stats);
+        writer.flush();
+        if (stats) {
+            StageClock closeClock;
+            out.close();
+            writeTime += closeClock.elapsed();
+            StageTime serializeTime = clock->elapsed();
+            serializeTime -= writeTime;
+            writeTime.runs = 1;
+            stats->add(Stage::Serialize, serializeTime);
+            stats->add(Stage::Write, writeTime);
+            stats->events += job.stats.events;
+            stats->pens += job.stats.pens;
+            stats->outputBytes += job.stats.bytes;
+        }
+        job.paletteName = emitter->paletteName();
+        if (!out) job.error = "Failed to write output file";
+    } catch (const std::exception &e) {
+        job.error = e.what();
+    }
+}
+
+// <stem>.partNNN<ext>, numbered from 1 with at least three digits.
+static std::filesystem::path partPath(const std::filesystem::path &output, size_t part, size_t parts) {
+    std::string number = std::to_string(part + 1);
+    number.insert(0, std::max<size_t>(std::to_string(parts).size(), 3) - number.size(), '0');
+    auto path = output;
+    path.replace_filename(output.stem().string() + ".part" + number + output.extension().string());
+    return path;
+}
+
+// --shard: replaces every output with its parts, each covering shardLength ms of the chat up to
+// chatEnd.
+static void shardOutputs(Conversion &conversion, uint64_t chatEnd) {
+    const uint64_t length = *conversion.shardLength;
+    const size_t parts = static_cast<size_t>(std::max<uint64_t>((chatEnd + length - 1) / length, 1));
+    std::vector<OutputJob> outputs;
+    for (auto &job: conversion.outputs) {
+        if (!job.error.empty()) {
+            outputs.push_back(std::move(job));
+            continue;
+        }
+        for (size_t part = 0; part < parts; ++part) {
+            OutputJob &shard = outputs.emplace_back(job);
+            shard.outputPath = partPath(job.outputPath, part, parts);
+            shard.shardOf = job.outputPath;
+            shard.partFrom = part * length;
+            shard.partTo = (part + 1) * length;
+        }
+    }
+    conversion.outputs = std::move(outputs);
+}
+
+// Outputs that already failed (e.g. their config could not be loaded) are skipped.
+// The chat is parsed, wrapped once per distinct line width and separator and batched once per
+// distinct window size through cache, so outputs (and, with a shared cache, later conversions of
+// the same file) reuse what was made before. Inline chats are only shared between their outputs.
+static void runConversion(Conversion &conversion, int videoWidth, int videoHeight, bool parallelOutputs,
+                          ChatCache &cache) {
+    TraceScope trace("runConversion");
+    auto started = std::chrono::steady_clock::now();
+    ChatCache inlineCache;
+    ChatCache &chats = conversion.inlineData ? inlineCache : cache;
+    const std::string key = conversion.inlineData ? std::string() : chatKey(conversion);
+    std::shared_ptr<const std::vector<ChatMessage> > chat;
+    try {
+        chat = chats.chat(key, [&] {
+            if (conversion.stats) {
+                std::error_code ec;
+                conversion.stats->inputBytes += conversion.inlineData
+                                                    ? conversion.inlineData->size()
+                                                    : std::filesystem::file_size(conversion.inputPath, ec);
+            }
+            return readChat(conversion);
+        }, conversion.stats);
+        if (chat->empty()) {
+            conversion.error = "No chat messages in " +
+                               (conversion.inlineData ? std::string("request data") : conversion.inputPath.string());
+        }
+    } catch (const std::exception &e) {
+        conversion.error = e.what();
+    }
+
+    // Every part is wrapped and batched from its own range of the chat, with the messages before it
+    // that fill its window the way the part before it ended. Only the parts being written are in
+    // memory, never the batches of the whole chat.
+    if (conversion.shardLength && conversion.error.empty()) {
+        auto sorted = chat;
+        if (!std::ranges::is_sorted(*chat, {}, &ChatMessage::time)) {
+            auto copy = std::make_shared<std::vector<ChatMessage> >(*chat);
+            std::ranges::stable_sort(*copy, {}, &ChatMessage::time);
+            sorted = std::move(copy);
+        }
+        if (sorted->back().time >= maxSubtitleTime) {
+            conversion.error = "The chat runs past " + formatClipTime(maxSubtitleTime) +
+                               ", the latest time subtitles can have, so it cannot be sharded";
+            return;
+        }
+        shardOutputs(conversion, sorted->back().time + 1);
+        ThreadPool pool(conversion.jobs);
+        for (auto &job: conversion.outputs) {
+            if (!job.error.empty()) continue;
+            pool.submit([&conversion, &job, &sorted, videoWidth, videoHeight] {
+                PipelineStats *stats = conversion.stats;
+                auto range = chatRange(*sorted, job.partFrom, job.partTo,
+                                       static_cast<size_t>(std::max(job.params.totalDisplayLines, 0)));
+                auto wrapped = timeStage(stats, Stage::Wrap, [&] {
+                    return wrapMessages(std::vector<ChatMessage>(range.begin(), range.end()), job.params);
+                });
+                job.batches = std::make_shared<const std::vector<Batch> >(timeStage(stats, Stage::Batch, [&] {
+                    // The chat ends before maxSubtitleTime, only the last part's end can be past it.
+                    return clipBatches(generateBatches(wrapped, job.params.totalDisplayLines),
+                                       static_cast<int>(job.partFrom),
+                                       static_cast<int>(std::min(job.partTo, maxSubtitleTime)));
+                }));
+                if (stats) {
+                    for (const auto &message: wrapped) stats->lines += message.lines.size();
+                    stats->batches += job.batches->size();
+                }
+                wrapped.clear();
+                writeOutput(job, videoWidth, videoHeight, stats, conversion.budget);
+                job.batches.reset();
+            });
+        }
+        pool.wait();
+        conversion.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return;
+    }
+
+    std::vector<OutputJob *> pending;
+    if (conversion.error.empty()) {
+        for (auto &job: conversion.outputs) {
+            if (!job.error.empty()) continue;
+            job.batches = chats.batches(key, *chat, job.params, conversion.stats);
+            if (conversion.clipFrom || conversion.clipTo) {
+                // parseClipTime keeps both within maxSubtitleTime.
+                job.batches = std::make_shared<const std::vector<Batch> >(clipBatches(
+                    *job.batches, static_cast<int>(conversion.clipFrom.value_or(0)),
+                    static_cast<int>(conversion.clipTo.value_or(maxSubtitleTime))));
+            }
+            pending.push_back(&job);
+        }
+    }
+
+    if (!parallelOutputs || pending.size() == 1) {
+        for (auto *job: pending) writeOutput(*job, videoWidth, videoHeight, conversion.stats, conversion.budget);
+    } else {
+        std::vector<std::jthread> threads;
+        for (auto *job: pending) {
+            threads.emplace_back([job, videoWidth, videoHeight, stats = conversion.stats, budget = conversion.budget] {
+                Tracer::instance().nameThread("output writer");
+                writeOutput(*job, videoWidth, videoHeight, stats, budget);
+            });
+        }
+    }
+    conversion.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+// Reads a batch manifest: one output per line, tab separated
+//     config <TAB> input <TAB> output [<TAB> ms|sec]
+// Empty lines and lines starting with # are skipped, relative paths are relative to the manifest.
+// Lines with the same input and time unit become one conversion.
+static std::vector<Conversion> readManifest(const std::filesystem::path &manifestPath, const std::string &defaultTimeUnit,
+                                            const std::string &inputFormat) {
+    std::ifstream file(manifestPath);
+    if (!file) throw std::runtime_error("Cannot open manifest " + manifestPath.string());
+
+    std::vector<Conversion> conversions;
+    std::map<std::pair<std::filesystem::path, int>, size_t> byInput;
+    auto base = manifestPath.parent_path();
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line.front() == '#') continue;
+
+        std::vector<std::string> fields;
+        std::stringstream ss(line);
+        for (std::string field; std::getline(ss, field, '\t');) fields.push_back(field);
+        std::string where = manifestPath.string() + ":" + std::to_string(lineNumber);
+        if (fields.size() < 3 || fields.size() > 4) {
+            throw std::runtime_error(where + ": expected config, input and output separated by tabs");
+        }
+        std::string timeUnit = fields.size() == 4 ? fields[3] : defaultTimeUnit;
+        std::ranges::transform(timeUnit, timeUnit.begin(), ::tolower);
+        if (timeUnit != "ms" && timeUnit != "sec") {
+            throw std::runtime_error(where + ": time unit must be ms or sec");
+        }
+        int multiplier = (timeUnit == "sec") ? 1000 : 1;
+
+        auto inputPath = base / fields[1];
+        auto [it, added] = byInput.try_emplace({inputPath, multiplier}, conversions.size());
+        if (added) {
+            Conversion &conversion = conversions.emplace_back();
+            conversion.inputPath = inputPath;
+            conversion.irc = isIrcInput(inputPath, inputFormat);
+            conversion.timeMultiplier = multiplier;
+        }
+        OutputJob &job = conversions[it->second].outputs.emplace_back();
+        job.outputPath = base / fields[2];
+        auto configPath = base / fields[0];
+        if (!job.params.loadFromFile(configPath.c_str())) {
+            job.error = "Cannot open config file " + configPath.string();
+        }
+    }
+    return conversions;
+}
+
+// Rough peak memory of a conversion: the parsed and wrapped chat, and the batches, which hold a
+// copy of the window for every distinct timestamp.
+static uint64_t estimateMemory(const Conversion &conversion) {
+    std::error_code ec;
+    uint64_t inputSize = std::filesystem::file_size(conversion.inputPath, ec);
+    if (ec) return 0;
+    uint64_t windowLines = 0;
+    for (const auto &job: conversion.outputs) {
+        windowLines += std::max(job.params.totalDisplayLines, 1);
+    }
+    return inputSize * (4 + 2 * windowLines);
+}
+
+static void printOutput(const OutputJob &job) {
+    const SubtitleStats &stats = job.stats;
+    std::cout << "Successfully wrote subtitles to: " << job.outputPath << "\n";
+    std::cout << "Events: " << stats.events << ", size: " << stats.bytes << " bytes";
+    if (stats.pens) {
+        std::cout << ", " << job.paletteName << ": " << stats.pens << " (" << stats.distinctColors << " distinct username colors)";
+    }
+    std::cout << "\n";
+    if (!job.budgetSteps.empty()) std::cout << "Budget: " << job.budgetSteps << "\n";
+}
+
+// Lists the written parts of every sharded output in <output>.parts.tsv, tab separated:
+//     part <TAB> from <TAB> to <TAB> events <TAB> bytes <TAB> file
+// Times are h:mm:ss.mmm of the chat, files relative to the manifest.
+static bool writeShardManifests(const std::vector<OutputJob> &outputs) {
+    std::map<std::filesystem::path, std::vector<const OutputJob *> > byOutput;
+    for (const auto &job: outputs) {
+        if (!job.shardOf.empty() && job.error.empty()) byOutput[job.shardOf].push_back(&job);
+    }
+    bool ok = true;
+    for (const auto &[output, parts]: byOutput) {
+        auto path = output;
+        path += ".parts.tsv";
+        std::ofstream manifest(path);
+        manifest << "# part\tfrom\tto\tevents\tbytes\tfile\n";
+        for (const auto *part: parts) {
+            manifest << std::format("{}\t{}\t{}\t{}\t{}\t{}\n", part->partFrom / (part->partTo - part->partFrom) + 1,
+                                    formatClipTime(part->partFrom), formatClipTime(part->partTo), part->stats.events,
+                                    part->stats.bytes, part->outputPath.filename().string());
+        }
+        if (!manifest) {
+            std::cerr << "Error: Cannot write " << path << "\n";
+            ok = false;
+        } else {
+            std::cout << "Parts of " << output << " listed in " << path << "\n";
+        }
+    }
+    return ok;
+}
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+    stopRequested = 1;
+}
+
+// Feeds the lines of a live source (a followed file or a chat connection) through parser into
+// every output, keeping each a complete document, and into the overlay if there is one, until the
+// chat ends: on Ctrl+C, SIGTERM, when the source closes or after idleTimeout seconds without new
+// messages.
+template<typename Source, typename Parser>
+static int runLive(Source &source, Parser &parser, Conversion &conversion, OverlayServer *overlay,
+                   int videoWidth, int videoHeight, double idleTimeout) {
+    std::vector<std::unique_ptr<LiveOutput> > outputs;
+    for (const auto &job: conversion.outputs) {
+        outputs.push_back(std::make_unique<LiveOutput>(job.outputPath, job.params, videoWidth, videoHeight));
+    }
+    size_t messages = 0;
+    ChatMessage message;
+    auto onLine = [&](std::string_view line) {
+        if (!parser.parse(line, message)) return;
+        if (overlay) overlay->push(message);
+        for (auto &output: outputs) output->push(message);
+        messages++;
+    };
+
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    auto lastMessage = std::chrono::steady_clock::now();
+    while (!stopRequested) {
+        size_t before = messages;
+        source.read(onLine);
+        if (messages != before) {
+            for (auto &output: outputs) output->commit();
+            lastMessage = std::chrono::steady_clock::now();
+        } else if (idleTimeout > 0 &&
+                   std::chrono::steady_clock::now() - lastMessage >= std::chrono::duration<double>(idleTimeout)) {
+            break;
+        }
+        if (source.closed()) break;
+        source.wait(std::chrono::milliseconds(250));
+    }
+    source.read(onLine);
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        conversion.outputs[i].stats = outputs[i]->finish();
+        conversion.outputs[i].paletteName = outputs[i]->paletteName();
+    }
+    if (parser.skippedLines()) {
+        std::cerr << "Warning: Skipped " << parser.skippedLines() << " lines with an invalid time\n";
+    }
+    for (const auto &job: conversion.outputs) printOutput(job);
+    return 0;
+}
+
+// Runs every conversion of the manifest on one pool and reports each as it finishes.
+// A failing conversion or output does not stop the others.
+static int runBatch(const std::filesystem::path &manifestPath, const std::string &defaultTimeUnit,
+                    const std::string &inputFormat, size_t jobs, uint64_t memoryBudget, int videoWidth, int videoHeight,
+                    PipelineStats *stats, const OutputBudget *outputBudget) {
+    std::vector<Conversion> conversions;
+    try {
+        conversions = readManifest(manifestPath, defaultTimeUnit, inputFormat);
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    std::mutex reportMutex;
+    size_t written = 0, failed = 0;
+    MemoryBudget budget(memoryBudget);
+    {
+        ThreadPool pool(jobs);
+        for (auto &conversion: conversions) {
+            conversion.stats = stats;
+            conversion.budget = outputBudget;
+            pool.submit([&] {
+                uint64_t reserved = budget.acquire(estimateMemory(conversion));
+                // Each conversion is one task, its outputs are written one after another.
+                ChatCache cache;
+                runConversion(conversion, videoWidth, videoHeight, false, cache);
+                budget.release(reserved);
+
+                std::lock_guard lock(reportMutex);
+                for (const auto &job: conversion.outputs) {
+                    const std::string &error = conversion.error.empty() ? job.error : conversion.error;
+                    if (error.empty()) {
+                        written++;
+                        std::cout << "ok    " << std::fixed << std::setprecision(2) << conversion.seconds << " s  "
+                                << job.outputPath.string() << " (" << job.stats.events << " events, "
+                                << job.stats.bytes << " bytes"
+                                << (job.budgetSteps.empty() ? "" : "; " + job.budgetSteps) << ")\n";
+                    } else {
+                        failed++;
+                        std::cout << "FAIL  " << std::fixed << std::setprecision(2) << conversion.seconds << " s  "
+                                << job.outputPath.string() << ": " << error << "\n";
+                    }
+                }
+                std::cout.flush();
+            });
+        }
+        pool.wait();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Batch: " << written << " written, " << failed << " failed, "
+            << std::fixed << std::setprecision(2) << seconds << " s\n";
+    return failed ? 1 : 0;
+}
+
+// Answers one daemon request: one line per output, then the connection is closed.
+//     ok <seconds> <events> <bytes> <output>
+//     error <output>: <message>
+// A request that cannot be read at all gets a single "error <message>" line.
+static void serveDaemonRequest(DaemonConnection &connection, ChatCache &cache, int videoWidth, int videoHeight) {
+    DaemonRequest request;
+    try {
+        request = connection.read();
+    } catch (const std::exception &e) {
+        connection.write(std::string("error ") + e.what() + "\n");
+        return;
+    }
+
+    Conversion conversion;
+    conversion.inputPath = request.input;
+    conversion.irc = request.inlineData ? request.inputFormat == "irc" : isIrcInput(request.input, request.inputFormat);
+    conversion.timeMultiplier = (request.timeUnit == "sec") ? 1000 : 1;
+    if (request.inlineData) conversion.inlineData = std::move(request.data);
+    conversion.outputs.resize(request.outputs.size());
+    for (size_t i = 0; i < request.outputs.size(); ++i) {
+        OutputJob &job = conversion.outputs[i];
+        job.outputPath = request.outputs[i];
+        try {
+            job.params = cache.config(request.configs[request.configs.size() == 1 ? 0 : i]);
+        } catch (const std::exception &e) {
+            job.error = e.what();
+        }
+    }
+    runConversion(conversion, request.videoWidth.value_or(videoWidth), request.videoHeight.value_or(videoHeight),
+                  false, cache);
+
+    std::ostringstream response;
+    for (const auto &job: conversion.outputs) {
+        const std::string &error = conversion.error.empty() ? job.error : conversion.error;
+        if (error.empty()) {
+            response << "ok " << std::fixed << std::setprecision(4) << conversion.seconds << " " << job.stats.events
+                    << " " << job.stats.bytes << " " << job.outputPath.string() << "\n";
+        } else {
+            response << "error " << job.outputPath.string() << ": " << error << "\n";
+        }
+    }
+    connection.write(response.str());
+}
+
+// Serves conversion requests on a Unix socket until Ctrl+C or SIGTERM, -j at a time. Configs,
+// parsed chats and their wrapped and batched forms stay cached between requests.
+static int runDaemon(const std::filesystem::path &socketPath, size_t jobs, uint64_t cacheSize, int videoWidth,
+                     int videoHeight) {
+#if defined(_WIN32)
+    std::cerr << "Error: --daemon is not supported on this platform\n";
+    return 1;
+#else
+    std::unique_ptr<DaemonSocket> socket;
+    try {
+        socket = std::make_unique<DaemonSocket>(socketPath);
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    std::cout << "Listening on " << socketPath.string() << std::endl;
+
+    ChatCache cache(cacheSize);
+    size_t served = 0;
+    {
+        ThreadPool pool(jobs);
+        while (!stopRequested) {
+            int fd = socket->accept(std::chrono::milliseconds(250));
+            if (fd < 0) continue;
+            served++;
+            pool.submit([&cache, fd, videoWidth, videoHeight] {
+                DaemonConnection connection(fd);
+                serveDaemonRequest(connection, cache, videoWidth, videoHeight);
+            });
+        }
+        pool.wait();
+    }
+    std::cout << "Served " << served << " requests, cache: " << cache.hits() << " hits, " << cache.misses()
+            << " misses\n";
+    return 0;
+#endif
+}
+
+// --analyze: one parse of the chat, reduced on the pool, then every config run through the
+// pipeline with nothing written, one config per pool thread.
+static int runAnalysis(const std::filesystem::path &inputPath, bool irc, int timeMultiplier,
+                       std::optional<uint64_t> startTime, const std::vector<std::filesystem::path> &configPaths,
+                       std::vector<int> widths, size_t jobs) {
+    std::vector<ChatParams> configs(configPaths.size());
+    for (size_t i = 0; i < configPaths.size(); ++i) {
+        if (!configs[i].loadFromFile(configPaths[i].c_str())) {
+            std::cerr << "Error: Cannot open config file: " << configPaths[i] << "\n";
+            return 1;
+        }
+    }
+    if (widths.empty()) {
+        widths = {20, 25, 30, 35, 40};
+        for (const auto &params: configs) widths.push_back(params.maxCharsPerLine);
+    }
+    std::ranges::sort(widths);
+    widths.erase(std::unique(widths.begin(), widths.end()), widths.end());
+
+    Conversion conversion;
+    conversion.inputPath = inputPath;
+    conversion.irc = irc;
+    conversion.timeMultiplier = timeMultiplier;
+    conversion.ircStartTime = startTime;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<ChatMessage> chat;
+    try {
+        chat = readChat(conversion);
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    auto parsed = std::chrono::steady_clock::now();
+
+    ThreadPool pool(jobs);
+    ChatAnalysis analysis = analyzeChat(chat, widths, configs.empty() ? ChatParams().usernameSeparator
+                                                                     : configs.front().usernameSeparator, pool);
+    std::vector<OutputPrediction> predictions(configs.size());
+    auto userColors = chatUserColors(chat);
+    for (size_t i = 0; i < configs.size(); ++i) {
+        pool.submit([&, i] { predictions[i] = predictOutput(chat, configs[i], userColors); });
+    }
+    pool.wait();
+    auto done = std::chrono::steady_clock::now();
+
+    printAnalysis(std::cout, analysis);
+    if (!configs.empty()) {
+        std::cout << "SRV3 output per config:\n";
+        std::cout << std::format("  {:<24} {:>5} {:>5} {:>10} {:>10} {:>5} {:>12}\n", "config", "width", "lines",
+                                 "batches", "events", "pens", "bytes");
+        for (size_t i = 0; i < configs.size(); ++i) {
+            const auto &stats = predictions[i].stats;
+            std::cout << std::format("  {:<24} {:>5} {:>5} {:>10} {:>10} {:>5} {:>12}\n",
+                                     configPaths[i].filename().string(), configs[i].maxCharsPerLine,
+                                     configs[i].totalDisplayLines, predictions[i].batches, stats.events, stats.pens,
+                                     stats.bytes);
+        }
+    }
+    std::cout << std::format("Parsed in {:.2f} s, analyzed in {:.2f} s on {} threads\n",
+                             std::chrono::duration<double>(parsed - start).count(),
+                             std::chrono::duration<double>(done - parsed).count(), pool.size());
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
-    CLI::App app{"Chat → YTT/SRV3 subtitle generator"};
+    CLI::App app{"Chat → YTT/SRV3/ASS/WebVTT/SRT subtitle generator"};
 
-    std::filesystem::path configPath, csvPath, outputPath;
-    std::string timeUnit;
+    std::vector<std::filesystem::path> configPaths, outputPaths;
+    std::filesystem::path inputPath, manifestPath;
+    std::string timeUnit, inputFormat = "auto";
+    int videoWidth = 1920, videoHeight = 1080;
+    size_t jobs = std::thread::hardware_concurrency();
+    uint64_t memoryBudgetMiB = 0;
 
-    app.add_option("-c,--config", configPath, "Path to INI config file")
-            ->required()
+    auto *configOption = app.add_option("-c,--config", configPaths,
+                                        "Path to INI config file; repeat once per output, or give one config for all outputs")
             ->check(CLI::ExistingFile);
-    app.add_option("-i,--input", csvPath, "Path to chat CSV file")
-            ->required()
+    auto *inputOption = app.add_option("-i,--input", inputPath, "Path to chat CSV file or raw IRC log")
             ->check(CLI::ExistingFile);
-    app.add_option("-o,--output", outputPath, "Output file (e.g. output.srv3 or output.ytt)")
-            ->required();
-    app.add_option("-u,--time-unit", timeUnit, "Time unit inside CSV: “ms” or “sec”")
-            ->required()
+    auto *outputOption = app.add_option("-o,--output", outputPaths,
+                                        "Output file, the format follows the extension (.srv3/.ytt, .ass, .vtt or .srt); may be repeated");
+    app.add_option("-u,--time-unit", timeUnit, "Time unit inside CSV: “ms” or “sec” (default for --batch: ms)")
             ->check(CLI::IsMember({"ms", "sec"}, CLI::ignore_case));
+    app.add_option("--input-format", inputFormat,
+                   "“csv”, “irc” (raw IRCv3 lines) or “auto”: .log and .irc files are IRC, anything else CSV")
+            ->check(CLI::IsMember({"auto", "csv", "irc"}, CLI::ignore_case));
+    app.add_option("--width", videoWidth, "Video width for ASS output")
+            ->check(CLI::PositiveNumber);
+    app.add_option("--height", videoHeight, "Video height for ASS output")
+            ->check(CLI::PositiveNumber);
+    auto *batchOption = app.add_option("--batch", manifestPath,
+                                       "Run every line of a TSV manifest (config, input, output[, time unit])")
+            ->check(CLI::ExistingFile);
+    app.add_option("-j,--jobs", jobs,
+                   "Conversions running at once in --batch and --daemon mode (default: hardware threads)")
+            ->check(CLI::PositiveNumber);
+    app.add_option("--memory-budget", memoryBudgetMiB,
+                   "Estimated memory in MiB that --batch conversions may use together (default: unlimited)");
+    batchOption->excludes(configOption)->excludes(inputOption)->excludes(outputOption);
+    bool follow = false;
+    double idleTimeout = 0;
+    auto *followOption = app.add_flag("--follow", follow,
+                                      "Keep reading the input while it grows and update the outputs as it does; "
+                                      "ends on Ctrl+C or --idle-timeout");
+    app.add_option("--idle-timeout", idleTimeout,
+                   "With --follow or --connect: stop after this many seconds without new messages (default: never)")
+            ->check(CLI::NonNegativeNumber);
+    followOption->excludes(batchOption);
+    std::string connectTo, channel;
+    std::optional<uint64_t> startTime;
+    auto *connectOption = app.add_option("--connect", connectTo,
+                                         "Read chat live from a Twitch compatible IRC server (host:port, plain TCP) "
+                                         "instead of --input");
+    app.add_option("--channel", channel, "Channel to join with --connect");
+    app.add_option("--start-time", startTime,
+                   "IRC input: Unix time in ms that subtitle time 0 corresponds to (default: the first message)");
+    connectOption->excludes(inputOption)->excludes(batchOption)->excludes(followOption);
+    std::optional<uint16_t> servePort;
+    app.add_option("--serve", servePort,
+                   "With --follow or --connect: serve the chat as a browser-source overlay on "
+                   "http://127.0.0.1:<port>/ styled by the (first) config; 0 picks a free port")
+            ->excludes(batchOption);
+
+    std::filesystem::path daemonSocket;
+    uint64_t cacheSizeMiB = 1024;
+    auto *daemonOption = app.add_option("--daemon", daemonSocket,
+                                        "Serve conversion requests on this Unix socket, keeping configs and "
+                                        "parsed chats cached between them");
+    app.add_option("--cache-size", cacheSizeMiB, "With --daemon: estimated MiB the cache may hold (default: 1024)");
+    daemonOption->excludes(batchOption)->excludes(configOption)->excludes(inputOption)->excludes(outputOption)
+            ->excludes(followOption)->excludes(connectOption);
+
+    bool printStats = false;
+    std::string statsJsonPath;
+    auto *statsOption = app.add_flag("--stats", printStats,
+                                     "Print wall and CPU time per stage, peak memory, counts and throughput when done");
+    auto *statsJsonOption = app.add_option("--stats-json", statsJsonPath,
+                                           "Write the --stats report as JSON to this file (- for stdout)");
+
+    std::filesystem::path tracePath;
+    app.add_option("--trace", tracePath,
+                   "Write a timeline of the run as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev)");
+
+    OutputBudget outputBudget;
+    auto *maxBytesOption = app.add_option("--max-bytes", outputBudget.maxBytes,
+                                          "Largest output in bytes; bigger outputs are compacted, then coalesced "
+                                          "and pen quantized as far as needed, or not written");
+    auto *maxEventsOption = app.add_option("--max-events", outputBudget.maxEvents,
+                                           "Most events per output, met like --max-bytes");
+    app.add_option("--coalesce", outputBudget.coalesceIntervals,
+                   "Frame coalescing intervals in ms a budget may use, mildest first, comma separated; "
+                   "0 for none (default: 100,250,500,1000,2000)")
+            ->delimiter(',')->check(CLI::NonNegativeNumber);
+    app.add_option("--pen-limits", outputBudget.penLimits,
+                   "maxPens values a budget may use, mildest first, comma separated; 0 for none "
+                   "(default: 64,32,16,8)")
+            ->delimiter(',')->check(CLI::NonNegativeNumber);
+    for (auto *option: {maxBytesOption, maxEventsOption}) {
+        option->excludes(followOption)->excludes(connectOption)->excludes(daemonOption);
+    }
+
+    double shardHours = 0;
+    auto *shardOption = app.add_option("--shard", shardHours,
+                                       "Cut every output into parts of this many hours (<output stem>.part001 ...), "
+                                       "written in parallel on -j threads and listed in <output>.parts.tsv")
+            ->check(CLI::PositiveNumber);
+    shardOption->excludes(batchOption)->excludes(followOption)->excludes(connectOption)->excludes(daemonOption);
+
+    std::string clipFrom, clipTo;
+    auto *fromOption = app.add_option("--from", clipFrom,
+                                      "Only write the chat from this time on (seconds, m:ss or h:mm:ss), with output "
+                                      "times counted from it; CSV input is read through an index saved as <input>.idx");
+    auto *toOption = app.add_option("--to", clipTo, "Only write the chat up to this time, like --from");
+    for (auto *option: {fromOption, toOption}) {
+        option->excludes(batchOption)->excludes(followOption)->excludes(connectOption)->excludes(daemonOption)
+                ->excludes(shardOption);
+    }
+
+    bool analyze = false;
+    std::vector<int> analyzeWidths;
+    auto *analyzeOption = app.add_flag("--analyze", analyze,
+                                       "Report message rates, wrapping, users and duplicates of --input and the "
+                                       "events and SRV3 size each --config would give, without writing subtitles");
+    app.add_option("--analyze-widths", analyzeWidths,
+                   "maxCharsPerLine values --analyze wraps at, comma separated "
+                   "(default: 20,25,30,35,40 and those of the configs)")
+            ->delimiter(',')->check(CLI::PositiveNumber);
+    analyzeOption->excludes(batchOption)->excludes(outputOption)->excludes(followOption)->excludes(connectOption)
+            ->excludes(daemonOption)->excludes(fromOption)->excludes(toOption)
+            ->excludes(shardOption);
+    // The stages are only measured for single and --batch conversions.
+    for (auto *option: {statsOption, statsJsonOption}) {
+        option->excludes(followOption)->excludes(connectOption)->excludes(daemonOption)->excludes(analyzeOption);
+    }
 
     CLI11_PARSE(app, argc, argv);
 
-    int multiplier = (timeUnit == "sec") ? 1000 : 1;
+    // Written when main returns, after every thread of the run has finished.
+    struct TraceFile {
+        std::filesystem::path path;
 
-    ChatParams params;
-    if (!params.loadFromFile(configPath.c_str())) {
-        std::cerr << "Error: Cannot open config file: " << configPath << "\n";
-        return 1;
+        ~TraceFile() {
+            if (path.empty()) return;
+            std::ofstream out(path);
+            Tracer::instance().write(out);
+            if (!out) std::cerr << "Error: Cannot write trace file " << path << "\n";
+        }
+    } traceFile{tracePath};
+    if (!tracePath.empty()) {
+        Tracer::instance().start();
+        Tracer::instance().nameThread("main");
+    }
+
+    std::unique_ptr<PipelineStats> stats;
+    if (printStats || !statsJsonPath.empty()) stats = std::make_unique<PipelineStats>();
+    auto reportStats = [&] {
+        if (!stats) return;
+        if (printStats) stats->print(std::cout);
+        if (statsJsonPath == "-") {
+            stats->printJson(std::cout);
+        } else if (!statsJsonPath.empty()) {
+            std::ofstream json(statsJsonPath);
+            stats->printJson(json);
+            if (!json) std::cerr << "Error: Cannot write " << statsJsonPath << "\n";
+        }
+    };
+
+    if (!daemonSocket.empty()) {
+        return runDaemon(daemonSocket, jobs, cacheSizeMiB << 20, videoWidth, videoHeight);
+    }
+
+    if (!manifestPath.empty()) {
+        int result = runBatch(manifestPath, timeUnit.empty() ? "ms" : timeUnit, inputFormat, jobs,
+                              memoryBudgetMiB << 20, videoWidth, videoHeight, stats.get(), &outputBudget);
+        reportStats();
+        return result;
+    }
+
+    if (analyze) {
+        if (inputPath.empty() || (!isIrcInput(inputPath, inputFormat) && timeUnit.empty())) {
+            std::cerr << "Error: --analyze needs --input, CSV input also needs --time-unit\n";
+            return 1;
+        }
+        return runAnalysis(inputPath, isIrcInput(inputPath, inputFormat), timeUnit == "sec" ? 1000 : 1, startTime,
+                           configPaths, analyzeWidths, jobs);
     }
 
-    auto chat = parseCSV(csvPath, multiplier);
-    if (chat.empty()) {
-        std::cerr << "Error: Failed to parse chat CSV or it's empty: " << csvPath << "\n";
+    const bool live = follow || !connectTo.empty();
+    const bool irc = !connectTo.empty() || isIrcInput(inputPath, inputFormat);
+    if (configPaths.empty() || (outputPaths.empty() && !servePort) || (inputPath.empty() && connectTo.empty()) ||
+        (!irc && timeUnit.empty())) {
+        std::cerr << "Error: --config, --output and --input (or --connect) are required unless --batch is used, "
+                "CSV input also needs --time-unit\n";
         return 1;
     }
+    if (servePort && !live) {
+        std::cerr << "Error: --serve needs --follow or --connect\n";
+        return 1;
+    }
+    if (!connectTo.empty() && channel.empty()) {
+        std::cerr << "Error: --connect needs --channel\n";
+        return 1;
+    }
+    if (configPaths.size() != 1 && configPaths.size() != outputPaths.size()) {
+        std::cerr << "Error: Give either one config for all outputs or one config per output ("
+                << configPaths.size() << " configs, " << outputPaths.size() << " outputs)\n";
+        return 1;
+    }
+
+    Conversion conversion;
+    conversion.inputPath = inputPath;
+    conversion.irc = irc;
+    conversion.timeMultiplier = (timeUnit == "sec") ? 1000 : 1;
+    conversion.ircStartTime = startTime;
+    conversion.outputs.resize(outputPaths.size());
+    for (size_t i = 0; i < outputPaths.size(); ++i) {
+        const auto &configPath = configPaths[configPaths.size() == 1 ? 0 : i];
+        conversion.outputs[i].outputPath = outputPaths[i];
+        if (!conversion.outputs[i].params.loadFromFile(configPath.c_str())) {
+            std::cerr << "Error: Cannot open config file: " << configPath << "\n";
+            return 1;
+        }
+    }
 
-    std::string xml = generateXML(generateBatches(chat,params), params);
+    if (live) {
+        try {
+            std::unique_ptr<OverlayServer> overlay;
+            if (servePort) {
+                ChatParams overlayParams;
+                if (!overlayParams.loadFromFile(configPaths.front().c_str())) {
+                    std::cerr << "Error: Cannot open config file: " << configPaths.front() << "\n";
+                    return 1;
+                }
+                overlay = std::make_unique<OverlayServer>(*servePort, overlayParams);
+                std::cout << "Overlay: http://127.0.0.1:" << overlay->port() << "/" << std::endl;
+            }
+            IrcLineParser ircParser(startTime);
+            if (!connectTo.empty()) {
+                size_t colon = connectTo.rfind(':');
+                if (colon == std::string::npos) throw std::runtime_error("--connect expects host:port");
+                IrcConnection connection(connectTo.substr(0, colon), connectTo.substr(colon + 1), channel);
+                return runLive(connection, ircParser, conversion, overlay.get(), videoWidth, videoHeight,
+                               idleTimeout);
+            }
+            FileFollower follower(inputPath);
+            if (irc) {
+                return runLive(follower, ircParser, conversion, overlay.get(), videoWidth, videoHeight, idleTimeout);
+            }
+            CsvLineParser csvParser(conversion.timeMultiplier);
+            return runLive(follower, csvParser, conversion, overlay.get(), videoWidth, videoHeight, idleTimeout);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
 
-    std::ofstream out(outputPath);
-    if (!out) {
-        std::cerr << "Error: Cannot open output file: " << outputPath << "\n";
+    ChatCache cache;
+    conversion.stats = stats.get();
+    conversion.budget = &outputBudget;
+    try {
+        if (!clipFrom.empty()) conversion.clipFrom = parseClipTime(clipFrom);
+        if (!clipTo.empty()) conversion.clipTo = parseClipTime(clipTo);
+    } catch (const std::invalid_argument &e) {
+        std::cerr << "Error: " << e.what() << "\n";
         return 1;
     }
-    out << xml;
-    std::cout << "Successfully wrote subtitles to: " << outputPath << "\n";
-    return 0;
+    if (conversion.clipFrom.value_or(0) >= conversion.clipTo.value_or(std::numeric_limits<uint64_t>::max())) {
+        std::cerr << "Error: --from must be before --to\n";
+        return 1;
+    }
+    if (shardHours > 0) conversion.shardLength = std::max<uint64_t>(std::llround(shardHours * 3600000), 1);
+    conversion.jobs = jobs;
+    runConversion(conversion, videoWidth, videoHeight, true, cache);
+    if (!conversion.error.empty()) {
+        std::cerr << "Error: " << conversion.error << "\n";
+        return 1;
+    }
+
+    int result = 0;
+    for (const auto &job: conversion.outputs) {
+        if (!job.error.empty()) {
+            std::cerr << "Error: " << job.error << ": " << job.outputPath << "\n";
+            result = 1;
+            continue;
+        }
+        printOutput(job);
+    }
+    if (!writeShardManifests(conversion.outputs)) result = 1;
+    reportStats();
+    return result;
 }
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// One conversion asked of the daemon. A request is a few "key value" lines (ended by \n or \r\n)
+// ended by an empty line:
+//     config <path>           repeatable, one for all outputs or one per output
+//     output <path>           repeatable, the format follows the extension
+//     input <path>            a chat file, or instead:
+//     data <size>             size bytes of chat right after the empty line, at most maxDaemonData
+//     unit ms|sec             CSV time unit, default ms
+//     format auto|csv|irc     default auto (by the input extension; inline data is CSV unless irc)
+//     width <px>, height <px> video size for ASS output
+// Relative paths are relative to the daemon's working directory.
+struct DaemonRequest {
+    std::vector<std::filesystem::path> configs;
+    std::vector<std::filesystem::path> outputs;
+    std::filesystem::path input;
+    std::string data;
+    bool inlineData = false;
+    std::string timeUnit = "ms";
+    std::string inputFormat = "auto";
+    std::optional<int> videoWidth;
+    std::optional<int> videoHeight;
+};
+
+// Inline chat data a request may send. The buffer is allocated up front, so a larger size is
+// refused rather than trusted.
+inline constexpr size_t maxDaemonData = size_t{1} << 30;
+
+// Throws std::runtime_error with a message for the client when the request is malformed.
+inline DaemonRequest parseDaemonRequest(std::string_view header) {
+    DaemonRequest request;
+    size_t dataSize = 0;
+    while (!header.empty()) {
+        size_t end = header.find('\n');
+        std::string_view line = header.substr(0, end);
+        header = end == std::string_view::npos ? std::string_view() : header.substr(end + 1);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty()) continue;
+
+        size_t space = line.find(' ');
+        std::string_view key = line.substr(0, space);
+        std::string value(space == std::string_view::npos ? std::string_view() : line.substr(space + 1));
+        auto number = [&] {
+            try {
+                return std::stoi(value);
+            } catch (const std::logic_error &) {
+                throw std::runtime_error("Invalid number \"" + value + "\" for " + std::string(key));
+            }
+        };
+        if (key == "config") request.configs.emplace_back(value);
+        else if (key == "output") request.outputs.emplace_back(value);
+        else if (key == "input") request.input = value;
+        else if (key == "data") {
+            request.inlineData = true;
+            int size = number();
+            if (size < 0 || static_cast<size_t>(size) > maxDaemonData) {
+                throw std::runtime_error("data size must be between 0 and " + std::to_string(maxDaemonData) +
+                                         " bytes");
+            }
+            dataSize = static_cast<size_t>(size);
+        } else if (key == "unit") request.timeUnit = value;
+        else if (key == "format") request.inputFormat = value;
+        else if (key == "width") request.videoWidth = number();
+        else if (key == "height") request.videoHeight = number();
+        else throw std::runtime_error("Unknown request field \"" + std::string(key) + "\"");
+    }
+    if (request.configs.empty() || request.outputs.empty()) throw std::runtime_error("config and output are required");
+    if (request.configs.size() != 1 && request.configs.size() != request.outputs.size()) {
+        throw std::runtime_error("Give either one config for all outputs or one config per output");
+    }
+    if (request.input.empty() == !request.inlineData) throw std::runtime_error("Give either input or data");
+    if (request.timeUnit != "ms" && request.timeUnit != "sec") throw std::runtime_error("unit must be ms or sec");
+    if (request.inputFormat != "auto" && request.inputFormat != "csv" && request.inputFormat != "irc") {
+        throw std::runtime_error("format must be auto, csv or irc");
+    }
+    request.data.resize(dataSize);
+    return request;
+}
+
+// The end of a request header: where its empty line starts and where the data after it starts,
+// or nullopt when the empty line has not arrived yet.
+inline std::optional<std::pair<size_t, size_t> > findDaemonHeaderEnd(std::string_view received) {
+    for (size_t lineStart = 0;;) {
+        size_t newline = received.find('\n', lineStart);
+        if (newline == std::string_view::npos) return std::nullopt;
+        std::string_view line = received.substr(lineStart, newline - lineStart);
+        if (line.empty() || line == "\r") return std::make_pair(lineStart, newline + 1);
+        lineStart = newline + 1;
+    }
+}
+
+#if !defined(_WIN32)
+// A client of the daemon; the connection is closed when it goes out of scope. A client that
+// neither sends nor reads for ioTimeout is given up on, so it cannot hold a worker forever.
+class DaemonConnection {
+public:
+    static constexpr std::chrono::seconds ioTimeout{30};
+
+    explicit DaemonConnection(int fd) : fd(fd) {
+        timeval timeout{static_cast<time_t>(ioTimeout.count()), 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    DaemonConnection(const DaemonConnection &) = delete;
+
+    DaemonConnection &operator=(const DaemonConnection &) = delete;
+
+    ~DaemonConnection() {
+        ::close(fd);
+    }
+
+    // Reads the request, including its inline data. Throws std::runtime_error.
+    DaemonRequest read() {
+        std::string received;
+        std::optional<std::pair<size_t, size_t> > headerEnd;
+        while (!(headerEnd = findDaemonHeaderEnd(received))) {
+            if (received.size() > maxHeader) throw std::runtime_error("Request header too long");
+            char chunk[4096];
+            size_t count = receive(chunk, sizeof(chunk));
+            if (!count) throw std::runtime_error("Connection closed before the end of the request");
+            received.append(chunk, count);
+        }
+        auto [headerSize, dataStart] = *headerEnd;
+        DaemonRequest request = parseDaemonRequest(std::string_view(received).substr(0, headerSize));
+        size_t have = std::min(received.size() - dataStart, request.data.size());
+        std::copy_n(received.begin() + static_cast<std::ptrdiff_t>(dataStart), have, request.data.begin());
+        while (have < request.data.size()) {
+            size_t count = receive(request.data.data() + have, request.data.size() - have);
+            if (!count) throw std::runtime_error("Connection closed before the end of the data");
+            have += count;
+        }
+        return request;
+    }
+
+    // Returns false when the client went away.
+    bool write(std::string_view text) {
+        while (!text.empty()) {
+            ssize_t count = ::send(fd, text.data(), text.size(), sendFlags);
+            if (count <= 0) return false;
+            text.remove_prefix(static_cast<size_t>(count));
+        }
+        return true;
+    }
+
+private:
+#if defined(MSG_NOSIGNAL)
+    static constexpr int sendFlags = MSG_NOSIGNAL;
+#else
+    static constexpr int sendFlags = 0;
+#endif
+    static constexpr size_t maxHeader = 64 << 10;
+
+    // Bytes received, 0 when the client went away. Throws std::runtime_error after ioTimeout
+    // without any.
+    size_t receive(char *buffer, size_t size) {
+        ssize_t count = recv(fd, buffer, size, 0);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            throw std::runtime_error("Timed out waiting for the request");
+        }
+        return count > 0 ? static_cast<size_t>(count) : 0;
+    }
+
+    int fd;
+};
+#endif
+
+// Listening Unix domain socket (POSIX only). A stale socket file left behind by a previous run is
+// replaced; the file is removed again on destruction. The socket is made accessible to its owner
+// only (0600) before it starts listening, as any client can have files read and written.
+class DaemonSocket {
+public:
+    explicit DaemonSocket(const std::filesystem::path &path) : path(path) {
+#if defined(_WIN32)
+        throw std::runtime_error("The conversion daemon is not supported on this platform");
+#else
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.string().size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path.string());
+        }
+        std::ranges::copy(path.string(), address.sun_path);
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0) throw std::runtime_error("Cannot create socket");
+        std::error_code ec;
+        if (std::filesystem::is_socket(path, ec)) std::filesystem::remove(path, ec);
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            chmod(address.sun_path, S_IRUSR | S_IWUSR) != 0 || listen(listenFd, 64) != 0) {
+            ::close(listenFd);
+            throw std::runtime_error("Cannot listen on " + path.string());
+        }
+#endif
+    }
+
+    DaemonSocket(const DaemonSocket &) = delete;
+
+    DaemonSocket &operator=(const DaemonSocket &) = delete;
+
+    ~DaemonSocket() {
+#if !defined(_WIN32)
+        ::close(listenFd);
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+#endif
+    }
+
+    // A new connection, or -1 when none arrived within the timeout (or a signal interrupted the wait).
+    int accept(std::chrono::milliseconds timeout) {
+#if !defined(_WIN32)
+        pollfd fd{listenFd, POLLIN, 0};
+        if (poll(&fd, 1, static_cast<int>(timeout.count())) <= 0) return -1;
+        return ::accept(listenFd, nullptr, nullptr);
+#else
+        return -1;
+#endif
+    }
+
+private:
+    std::filesystem::path path;
+    int listenFd = -1;
+};
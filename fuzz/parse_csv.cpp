@@ -0,0 +1,19 @@
+// libFuzzer harness for the chat CSV parser: the input is a whole CSV file. Malformed files are
+// rejected with an exception, which is fine; crashes, sanitizer reports and hangs are not.
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include "ytt_generator.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    std::string text(reinterpret_cast<const char *>(data), size);
+    for (int timeMultiplier: {1, 1000}) {
+        std::istringstream csv(text);
+        try {
+            parseCSV(csv, timeMultiplier, "fuzz input");
+        } catch (const std::exception &) {
+        }
+    }
+    return 0;
+}
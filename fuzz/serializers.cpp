@@ -0,0 +1,44 @@
+// libFuzzer harness for the whole conversion: the first four bytes pick the config (line width,
+// window lines, layout and flags, pen limit), the rest are CSV lines after the header. The chat
+// is wrapped, batched and written by every emitter.
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+#include "subtitle_writers.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < 4) return 0;
+    ChatParams params;
+    params.maxCharsPerLine = data[0] % 64;
+    params.totalDisplayLines = data[1] % 32;
+    params.layout = data[2] & 1 ? ChatLayout::Page : ChatLayout::Scroll;
+    params.compactOutput = data[2] & 2;
+    params.assMoveScroll = data[2] & 4;
+    params.textBold = data[2] & 8;
+    params.textAlignment = static_cast<TextAlignment>((data[2] >> 4) % 3);
+    params.maxPens = data[3] % 16;
+
+    std::istringstream csv(std::string(csvHeader) + "\n" +
+                           std::string(reinterpret_cast<const char *>(data) + 4, size - 4));
+    std::vector<Batch> batches;
+    try {
+        batches = generateBatches(parseCSV(csv, 1, "fuzz input"), params);
+    } catch (const std::exception &) {
+        return 0;
+    }
+
+    std::unique_ptr<SubtitleEmitter> emitters[] = {
+        std::make_unique<Srv3Emitter>(params), std::make_unique<AssEmitter>(params, 1920, 1080),
+        std::make_unique<SrtEmitter>(params), std::make_unique<WebVttEmitter>(params)
+    };
+    for (auto &emitter: emitters) {
+        DiscardBuffer discard;
+        std::ostream sink(&discard);
+        BufferedWriter writer(&sink);
+        writeSubtitles(*emitter, writer, batches);
+    }
+    return 0;
+}
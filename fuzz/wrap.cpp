@@ -0,0 +1,35 @@
+// libFuzzer harness for wrapMessage. The first byte is the line width (0-63), the rest is
+// username, separator and message, separated by newlines. Invalid UTF-8 throws utf8::exception,
+// which is fine; for valid input every line has to fit the width.
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include "ytt_generator.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < 1) return 0;
+    int maxWidth = data[0] % 64;
+    std::string_view rest(reinterpret_cast<const char *>(data) + 1, size - 1);
+    auto nextPart = [&rest] {
+        size_t newline = rest.find('\n');
+        std::string_view part = rest.substr(0, newline);
+        rest.remove_prefix(newline == std::string_view::npos ? rest.size() : newline + 1);
+        return std::string(part);
+    };
+    std::string username = nextPart();
+    std::string separator = nextPart();
+    std::string message(rest);
+
+    try {
+        auto [name, lines] = wrapMessage(username, separator, message, maxWidth);
+        int width = std::max(maxWidth, 1);
+        if (utf8_length(name) > width) std::abort();
+        for (const auto &line: lines) {
+            if (utf8_length(line) > width) std::abort();
+        }
+    } catch (const std::exception &) {
+    }
+    return 0;
+}
@@ -170,6 +170,50 @@ void ShowColorEdit(const char *label, Color &color) {
     }
 }
 
+// Decides when the GUI draws a frame. Nothing on screen changes without input, so once the frames
+// after the last event are drawn, the loop blocks in GLFW until the next one instead of redrawing
+// at vsync. ImGui settles a change over a couple of frames (layout uses the previous frame's sizes),
+// so every wake-up draws a few. While a widget is held, e.g. a slider being dragged, every mouse
+// move is an event; frames are then drawn at most once per frame budget and the events in between
+// are folded into the next one.
+class FramePacer {
+public:
+    static constexpr int framesPerWakeUp = 3;
+    static constexpr double frameBudget = 1.0 / 60; // seconds, while a widget is held
+    static constexpr double cursorBlink = 0.5;      // wake-up interval for the cursor of an active text field
+
+    // Returns when the next frame should be drawn. Call between frames, so ImGui's state is the
+    // last frame's.
+    void waitForFrame() {
+        const ImGuiIO &io = ImGui::GetIO();
+        if (pendingFrames > 0) {
+            glfwPollEvents();
+        } else {
+            if (io.WantTextInput) {
+                glfwWaitEventsTimeout(cursorBlink);
+            } else {
+                glfwWaitEvents();
+            }
+            pendingFrames = framesPerWakeUp;
+        }
+        if (ImGui::IsAnyItemActive()) {
+            pendingFrames = framesPerWakeUp;
+            double wait = lastFrame + frameBudget - glfwGetTime();
+            if (wait > 0) glfwWaitEventsTimeout(wait);
+        }
+        pendingFrames--;
+        lastFrame = glfwGetTime();
+    }
+
+    // Something other than input changed what is shown (a loaded image or chat).
+    void redraw() {
+        pendingFrames = framesPerWakeUp;
+    }
+
+private:
+    int pendingFrames = framesPerWakeUp;
+    double lastFrame = 0;
+};
 
 int main(int, char **) {
     glfwSetErrorCallback(glfw_error_callback);
@@ -213,8 +257,9 @@ int main(int, char **) {
 
     PreloadPreviewFont();
     InteractiveTextOverlay text_overlay{};
+    FramePacer pacer;
     while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+        pacer.waitForFrame();
         float new_dpi_scale = GetDPIScale(window);
         if (fabs(dpi_scale - new_dpi_scale) > 0.1f * std::max(fabs(dpi_scale), fabs(new_dpi_scale))) {
             dpi_scale = new_dpi_scale;
@@ -246,6 +291,7 @@ int main(int, char **) {
                     preview_texture = 0;
                 }
                 bool ret = LoadTextureFromFile(outPath, &preview_texture, &preview_width, &preview_height);
+                pacer.redraw();
                 if (!ret)
                     printf("Failed to load image: %s\n", outPath);
                 NFD_FreePathU8(outPath);
@@ -267,8 +313,13 @@ int main(int, char **) {
             nfdresult_t result = NFD_OpenDialogU8_With(&outPath, &args);
             if (result == NFD_OKAY) {
                 int multiplier = 1; // TODO: some way to customize time units
-                text_overlay.messages = parseCSV(outPath, multiplier);
-                text_overlay.revalidatePreview = true;
+                try {
+                    text_overlay.messages = parseCSV(outPath, multiplier);
+                    text_overlay.revalidatePreview = true;
+                    pacer.redraw();
+                } catch (const std::exception &e) {
+                    printf("Error: %s\n", e.what());
+                }
                 NFD_FreePathU8(outPath);
             } else if (result == NFD_CANCEL) {
                 // Do nothing
@@ -289,6 +340,13 @@ int main(int, char **) {
         ShowColorEdit("Text Color", p.textForegroundColor);
         text_overlay.revalidatePreview += ImGui::SliderInt("Characters\nper line", &p.maxCharsPerLine, 5, 50);
         text_overlay.revalidatePreview += ImGui::SliderInt("Line\nCount", &p.totalDisplayLines, 1, 50);
+        {
+            int layout = static_cast<int>(p.layout);
+            if (ImGui::Combo("Layout", &layout, "Scroll\0Page\0")) {
+                p.layout = static_cast<ChatLayout>(layout);
+                text_overlay.revalidatePreview = true;
+            }
+        }
         text_overlay.revalidatePreview += ImGui::InputText("Username\nSeparator", &p.usernameSeparator);
         if (ImGui::Button("Load Config")) {
             nfdu8char_t *outPath = nullptr;
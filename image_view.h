@@ -12,6 +12,35 @@
 static ImFont *g_font = nullptr;
 
 
+// The preview text laid out over the image: positions relative to the image's top-left corner,
+// colors, and the box the chat takes. Measuring text and hashing username colors every frame is
+// what made an idle preview expensive, so this is only rebuilt when the preview lines, the params
+// or the image size change; moving the window only moves the origin.
+struct PreviewLayout {
+    struct Text {
+        ImVec2 offset;
+        ImU32 color;
+        const char *text; // into InteractiveTextOverlay::preview
+    };
+
+    std::vector<Text> texts;
+    float fontSize = 0;
+    ImVec2 boxMin, boxMax;
+    bool insidePicture = true;
+
+    // What it was laid out for.
+    bool valid = false;
+    ChatParams params;
+    ImVec2 imageSize;
+    int texHeight = 0;
+
+    bool matches(const ChatParams &currentParams, ImVec2 currentImageSize, int currentTexHeight) const {
+        return valid && currentImageSize.x == imageSize.x && currentImageSize.y == imageSize.y &&
+               currentTexHeight == texHeight && currentParams == params;
+    }
+};
+
+
 struct InteractiveTextOverlay {
 
     ChatParams params;
@@ -33,6 +62,7 @@ struct InteractiveTextOverlay {
     std::vector<std::pair<std::string, std::string>> preview;
     bool revalidatePreview = true;
     bool isInsidePicture = true;
+    PreviewLayout layout;
 
     void generatePreview() {
         preview.clear();
@@ -41,6 +71,11 @@ struct InteractiveTextOverlay {
             if (wrapped.empty()) {
                 continue;
             }
+            // A page only takes whole messages, the first one that does not fit would clear it.
+            if (params.layout == ChatLayout::Page && !preview.empty() &&
+                preview.size() + wrapped.size() > static_cast<size_t>(params.totalDisplayLines)) {
+                break;
+            }
             if (preview.size() < params.totalDisplayLines) {
                 preview.emplace_back(username, wrapped[0]);
             } else {
@@ -51,6 +86,40 @@ struct InteractiveTextOverlay {
             }
         }
         revalidatePreview = false;
+        layout.valid = false;
+    }
+
+    // Lays the preview out for an image shown at imageSize; the preview font has to be pushed.
+    void layOut(ImVec2 imageSize, int texHeight) {
+        layout.texts.clear();
+        layout.fontSize = realFontSize(texHeight) * (imageSize.y / static_cast<float>(texHeight));
+        float textScale = layout.fontSize / g_font->FontSize;
+        float boxWidth = ImGui::CalcTextSize("M").x * textScale;
+        const auto &textColor = params.textForegroundColor;
+        layout.boxMin = layout.boxMax = ImVec2(0, 0);
+        for (size_t i = 0; i < preview.size(); i++) {
+            ImVec2 offset(realX() * imageSize.x, realY(static_cast<int>(i)) * imageSize.y);
+            if (i == 0) {
+                layout.boxMin = offset;
+                layout.boxMax.x = offset.x + params.maxCharsPerLine * boxWidth;
+            }
+            const auto &[username, text] = preview[i];
+            if (!username.empty()) {
+                const Color userColor = getRandomColor(username);
+                layout.texts.push_back({offset, IM_COL32(userColor.r, userColor.g, userColor.b, textColor.a),
+                                        username.c_str()});
+                offset.x += ImGui::CalcTextSize(username.c_str()).x * textScale;
+            }
+            layout.boxMax.y = offset.y + ImGui::CalcTextSize(text.c_str()).y * textScale;
+            layout.texts.push_back({offset, IM_COL32(textColor.r, textColor.g, textColor.b, textColor.a),
+                                    text.c_str()});
+        }
+        layout.insidePicture = layout.boxMin.x >= 0 && layout.boxMin.y >= 0 &&
+                               layout.boxMax.x <= imageSize.x && layout.boxMax.y <= imageSize.y;
+        layout.valid = true;
+        layout.params = params;
+        layout.imageSize = imageSize;
+        layout.texHeight = texHeight;
     }
 
     std::vector<ChatMessage> messages = {
@@ -153,61 +222,22 @@ inline void ShowInteractiveImage(
         return;
     }
 
-    float desiredFontSize = overlay->realFontSize(texHeight) * scale;
-    ImGui::PushFont(g_font);
+    const PreviewLayout &layout = overlay->layout;
+    if (!layout.matches(overlay->params, imageSize, texHeight)) {
+        ImGui::PushFont(g_font);
+        overlay->layOut(imageSize, texHeight);
+        ImGui::PopFont();
+    }
 
-    float textScale = desiredFontSize / g_font->FontSize;
     ImDrawList *drawList = ImGui::GetWindowDrawList();
-    ImVec2 letterSize = ImGui::CalcTextSize("M");
-    float boxWidth = letterSize.x * textScale;
-    ImVec2 startPos;
-    ImVec2 endPos;
-    for (int i = 0; i < overlay->preview.size(); i++) {
-        ImVec2 textPos(imgPos.x + overlay->realX() * imageSize.x, imgPos.y + overlay->realY(i) * imageSize.y);
-
-        if (i == 0) {
-            startPos = textPos;
-            endPos.x = startPos.x + overlay->params.maxCharsPerLine * boxWidth;
-        }
-
-        const char *firstText = overlay->preview[i].first.c_str();
-        ImVec2 firstBaseTextSize = ImGui::CalcTextSize(firstText);
-
-        ImVec2 firstTextSize(firstBaseTextSize.x * textScale, firstBaseTextSize.y * textScale);
-
-
-        const char *secondText = overlay->preview[i].second.c_str();
-
-        ImVec2 secondBaseTextSize = ImGui::CalcTextSize(secondText);
-
-        ImVec2 secondTextSize(secondBaseTextSize.x * textScale, secondBaseTextSize.y * textScale);
-
-
-        const Color randomColor = getRandomColor(firstText);
-        const auto &textColor = overlay->params.textForegroundColor;
-        drawList->AddText(g_font, desiredFontSize, textPos,
-                          IM_COL32(randomColor.r, randomColor.g, randomColor.b, textColor.a),
-                          firstText);
-
-
-        textPos.x += firstTextSize.x;
-        endPos.y = textPos.y + secondTextSize.y;
-        drawList->AddText(g_font, desiredFontSize, textPos,
-                          IM_COL32(textColor.r, textColor.g, textColor.b, textColor.a),
-                          secondText);
-
+    for (const auto &text: layout.texts) {
+        drawList->AddText(g_font, layout.fontSize, imgPos + text.offset, text.color, text.text);
     }
-    ImGui::PopFont();
-
-    const ImVec2 imgEndPos = imgPos + imageSize;
-    overlay->isInsidePicture = startPos.x >= imgPos.x &&
-                               startPos.y >= imgPos.y &&
-                               endPos.x <= imgEndPos.x &&
-                               endPos.y <= imgEndPos.y;
 
-    ImGui::GetWindowDrawList()->AddRect(
-            startPos,
-            endPos,
+    overlay->isInsidePicture = layout.insidePicture;
+    drawList->AddRect(
+            imgPos + layout.boxMin,
+            imgPos + layout.boxMax,
             overlay->isInsidePicture ? IM_COL32(255, 255, 0, 200) : IM_COL32(255, 0, 0, 255),
             0.0f,
             0,
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <optional>
+#include <string_view>
+
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "ytt_generator.h"
+
+// Views into one raw IRC line: [@tags] [:prefix] COMMAND [params] [:trailing]
+struct IrcLine {
+    std::string_view tags;     // without the leading @
+    std::string_view prefix;   // without the leading :
+    std::string_view command;
+    std::string_view params;   // middle parameters, space separated
+    std::string_view trailing; // last parameter, without the leading :
+};
+
+inline std::string_view ircTakeWord(std::string_view &rest) {
+    size_t space = rest.find(' ');
+    std::string_view word = rest.substr(0, space);
+    rest = space == std::string_view::npos ? std::string_view() : rest.substr(space + 1);
+    while (!rest.empty() && rest.front() == ' ') rest.remove_prefix(1);
+    return word;
+}
+
+// Splits a line without copying; returns false when there is no command.
+inline bool splitIrcLine(std::string_view line, IrcLine &irc) {
+    irc = {};
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) line.remove_suffix(1);
+    if (!line.empty() && line.front() == '@') {
+        line.remove_prefix(1);
+        irc.tags = ircTakeWord(line);
+    }
+    if (!line.empty() && line.front() == ':') {
+        line.remove_prefix(1);
+        irc.prefix = ircTakeWord(line);
+    }
+    irc.command = ircTakeWord(line);
+    size_t trailing = line.starts_with(':') ? 0 : line.find(" :");
+    if (trailing == std::string_view::npos) {
+        irc.params = line;
+    } else {
+        irc.params = line.substr(0, trailing);
+        irc.trailing = line.substr(trailing + (trailing == 0 ? 1 : 2));
+    }
+    return !irc.command.empty();
+}
+
+// Value of a tag, still escaped; empty when the tag is missing or has no value.
+inline std::string_view ircTag(std::string_view tags, std::string_view key) {
+    while (!tags.empty()) {
+        size_t end = tags.find(';');
+        std::string_view tag = tags.substr(0, end);
+        tags = end == std::string_view::npos ? std::string_view() : tags.substr(end + 1);
+        if (tag.size() > key.size() && tag.starts_with(key) && tag[key.size()] == '=') {
+            return tag.substr(key.size() + 1);
+        }
+    }
+    return {};
+}
+
+// IRCv3 tag value escaping: \: is ;, \s is a space, \\ a backslash, \r and \n line breaks.
+inline std::string unescapeIrcTag(std::string_view value) {
+    std::string result;
+    result.reserve(value.size());
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] != '\\') {
+            result.push_back(value[i]);
+            continue;
+        }
+        if (++i == value.size()) break;
+        switch (value[i]) {
+            case ':': result.push_back(';');
+                break;
+            case 's': result.push_back(' ');
+                break;
+            case 'r': result.push_back('\r');
+                break;
+            case 'n': result.push_back('\n');
+                break;
+            default: result.push_back(value[i]);
+        }
+    }
+    return result;
+}
+
+// Twitch chat as raw IRCv3 lines (PRIVMSG with tags). The username is display-name (or the nick),
+// the color comes from the color tag and the time from tmi-sent-ts.
+// Times are relative to startTime (Unix ms); by default the first message is at 0.
+class IrcLineParser {
+public:
+    explicit IrcLineParser(std::optional<uint64_t> startTime = std::nullopt) : startTime(startTime) {
+    }
+
+    // Returns false for lines that are not chat messages (server notices, joins, PINGs...).
+    // Messages without tmi-sent-ts get the time of the message before them.
+    bool parse(std::string_view line, ChatMessage &message) {
+        IrcLine irc;
+        if (!splitIrcLine(line, irc) || irc.command != "PRIVMSG") return false;
+
+        std::string_view sentAt = ircTag(irc.tags, "tmi-sent-ts");
+        uint64_t sent = 0;
+        if (!sentAt.empty() && std::from_chars(sentAt.data(), sentAt.data() + sentAt.size(), sent).ec == std::errc()) {
+            if (!startTime) startTime = sent;
+            lastTime = sent > *startTime ? sent - *startTime : 0;
+        }
+        message.time = lastTime;
+
+        std::string_view displayName = ircTag(irc.tags, "display-name");
+        message.user.name = !displayName.empty()
+                                ? unescapeIrcTag(displayName)
+                                : std::string(irc.prefix.substr(0, irc.prefix.find('!')));
+        std::string_view color = ircTag(irc.tags, "color");
+        message.user.color = color.empty() ? getRandomColor(message.user.name) : Color(std::string(color));
+
+        std::string_view text = irc.trailing;
+        // /me messages: \x01ACTION text\x01
+        if (text.starts_with("\x01" "ACTION ")) {
+            text.remove_prefix(8);
+            if (text.ends_with('\x01')) text.remove_suffix(1);
+        }
+        message.message.assign(text);
+        return true;
+    }
+
+    // Only CSV input can have malformed lines worth reporting, IRC traffic is simply filtered.
+    size_t skippedLines() const {
+        return 0;
+    }
+
+private:
+    std::optional<uint64_t> startTime;
+    uint64_t lastTime = 0;
+};
+
+inline std::vector<ChatMessage> parseIrcLog(std::istream &file, std::optional<uint64_t> startTime = std::nullopt) {
+    TraceScope trace("parseIrcLog");
+    std::vector<ChatMessage> messages;
+    IrcLineParser parser(startTime);
+    std::string line;
+    ChatMessage message;
+    while (std::getline(file, line)) {
+        if (parser.parse(line, message)) messages.push_back(std::move(message));
+    }
+    return messages;
+}
+
+// Reads a raw IRC log. Throws std::runtime_error when the file cannot be opened.
+inline std::vector<ChatMessage> parseIrcLog(const std::filesystem::path &filename,
+                                            std::optional<uint64_t> startTime = std::nullopt) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file " + filename.string());
+    }
+    return parseIrcLog(file, startTime);
+}
+
+// Anonymous read-only connection to a Twitch compatible chat server (plain TCP, POSIX only).
+// Answers PINGs itself and hands out every other line.
+class IrcConnection {
+public:
+    IrcConnection(const std::string &host, const std::string &port, std::string channel) {
+#if defined(_WIN32)
+        throw std::runtime_error("Connecting to a chat server is not supported on this platform");
+#else
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addresses = nullptr;
+        if (int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses); error != 0) {
+            throw std::runtime_error("Cannot resolve " + host + ": " + gai_strerror(error));
+        }
+        for (addrinfo *address = addresses; address && socketFd < 0; address = address->ai_next) {
+            socketFd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (socketFd >= 0 && connect(socketFd, address->ai_addr, address->ai_addrlen) != 0) {
+                ::close(socketFd);
+                socketFd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (socketFd < 0) throw std::runtime_error("Cannot connect to " + host + ":" + port);
+
+        if (!channel.starts_with('#')) channel.insert(channel.begin(), '#');
+        send("CAP REQ :twitch.tv/tags\r\n"
+             "NICK justinfan" + std::to_string(10000 + std::chrono::steady_clock::now().time_since_epoch().count() % 80000) + "\r\n"
+             "JOIN " + channel + "\r\n");
+#endif
+    }
+
+    IrcConnection(const IrcConnection &) = delete;
+
+    IrcConnection &operator=(const IrcConnection &) = delete;
+
+    ~IrcConnection() {
+#if !defined(_WIN32)
+        if (socketFd >= 0) ::close(socketFd);
+#endif
+    }
+
+    // Calls onLine(std::string_view) for every complete line received so far, without blocking.
+    template<typename OnLine>
+    size_t read(OnLine &&onLine) {
+        size_t lines = 0;
+#if !defined(_WIN32)
+        char chunk[1 << 16];
+        while (!ended) {
+            ssize_t count = recv(socketFd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                ended = true;
+                break;
+            }
+            if (count < 0) break;
+            pending.append(chunk, static_cast<size_t>(count));
+        }
+        size_t lineStart = 0;
+        for (size_t newline = pending.find('\n'); newline != std::string::npos;
+             newline = pending.find('\n', lineStart)) {
+            std::string_view line(pending.data() + lineStart, newline - lineStart);
+            lineStart = newline + 1;
+            if (line.ends_with('\r')) line.remove_suffix(1);
+            IrcLine irc;
+            if (splitIrcLine(line, irc) && irc.command == "PING") {
+                send("PONG :" + std::string(irc.trailing) + "\r\n");
+                continue;
+            }
+            onLine(line);
+            lines++;
+        }
+        pending.erase(0, lineStart);
+#endif
+        return lines;
+    }
+
+    // Blocks until data arrives or the timeout passed.
+    bool wait(std::chrono::milliseconds timeout) {
+#if !defined(_WIN32)
+        if (ended) return false;
+        pollfd fd{socketFd, POLLIN, 0};
+        return poll(&fd, 1, static_cast<int>(timeout.count())) > 0;
+#else
+        return false;
+#endif
+    }
+
+    // The server closed the connection.
+    bool closed() const {
+        return ended;
+    }
+
+private:
+#if !defined(_WIN32)
+    void send(const std::string &data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t count = ::send(socketFd, data.data() + sent, data.size() - sent, sendFlags);
+            if (count <= 0) {
+                ended = true;
+                return;
+            }
+            sent += static_cast<size_t>(count);
+        }
+    }
+
+#if defined(MSG_NOSIGNAL)
+    static constexpr int sendFlags = MSG_NOSIGNAL; // a closed connection ends the read loop, not the process
+#else
+    static constexpr int sendFlags = 0;
+#endif
+    int socketFd = -1;
+#endif
+    std::string pending;
+    bool ended = false;
+};
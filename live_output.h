@@ -0,0 +1,76 @@
+#pragma once
+
+#include <fstream>
+#include <set>
+
+#include "subtitle_writers.h"
+
+// Keeps one subtitle file up to date while chat messages keep arriving.
+// Events are appended as soon as their batch ends. commit() writes the footer behind them, so the
+// file is a complete document between updates; the next update simply overwrites the footer.
+// Username colors are not known in advance, so the palette is fixed to Twitch's default colors and
+// any other color shows as the nearest of them.
+class LiveOutput {
+public:
+    LiveOutput(const std::filesystem::path &path, const ChatParams &params, int videoWidth, int videoHeight)
+        : params(params), file(path, std::ios::out | std::ios::trunc), writer(&file),
+          emitter(makeEmitter(path, params, videoWidth, videoHeight)), batcher(params.totalDisplayLines) {
+        if (!file) throw std::runtime_error("Cannot open output file " + path.string());
+        emitter->begin(writer, defaultUserColors());
+        commit();
+    }
+
+    LiveOutput(const LiveOutput &) = delete;
+
+    LiveOutput &operator=(const LiveOutput &) = delete;
+
+    // Messages are expected in time order; the newest batch is held back until the next one
+    // tells when it ends.
+    void push(const ChatMessage &message) {
+        WrappedMessage wrapped = wrapChatMessage(message, params);
+        if (wrapped.lines.empty()) return;
+        userColors.insert(message.user.color);
+        if (const Batch *batch = batcher.push(wrapped)) {
+            if (pending) emitter->batch(writer, *pending, std::max(batch->time, pending->time));
+            pending = *batch;
+        }
+    }
+
+    // Makes the file a complete document of everything that ended so far.
+    void commit() {
+        writer.flush();
+        auto eventsEnd = file.tellp();
+        emitter->footer(writer);
+        writer.flush();
+        file.flush();
+        file.seekp(eventsEnd);
+        if (!file) throw std::runtime_error("Failed to write output file");
+    }
+
+    // Like the file outputs, the last batch is not shown: nothing tells how long it lasts.
+    SubtitleStats finish() {
+        emitter->end(writer);
+        writer.flush();
+        file.flush();
+        if (!file) throw std::runtime_error("Failed to write output file");
+        SubtitleStats stats;
+        stats.distinctColors = userColors.size();
+        stats.pens = emitter->paletteSize();
+        stats.events = emitter->events();
+        stats.bytes = static_cast<size_t>(file.tellp());
+        return stats;
+    }
+
+    std::string_view paletteName() const {
+        return emitter->paletteName();
+    }
+
+private:
+    ChatParams params;
+    std::ofstream file;
+    BufferedWriter writer;
+    std::unique_ptr<SubtitleEmitter> emitter;
+    ChatBatcher batcher;
+    std::optional<Batch> pending;
+    std::set<Color> userColors;
+};
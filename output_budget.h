@@ -0,0 +1,125 @@
+#pragma once
+
+#include <format>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "subtitle_writers.h"
+
+// --max-bytes / --max-events: the output is measured by serializing it into a writer that only
+// counts. When it is over budget it is made smaller, lossless compaction first, then the least
+// lossy combination of frame coalescing and pen quantization that fits.
+struct OutputBudget {
+    size_t maxBytes = 0;  // 0 for no limit
+    size_t maxEvents = 0; // 0 for no limit
+    std::vector<int> coalesceIntervals = {100, 250, 500, 1000, 2000}; // ms, mildest first; 0 entries are skipped
+    std::vector<int> penLimits = {64, 32, 16, 8};                       // maxPens values, mildest first
+
+    bool limited() const {
+        return maxBytes || maxEvents;
+    }
+
+    bool fits(const SubtitleStats &stats) const {
+        return (!maxBytes || stats.bytes <= maxBytes) && (!maxEvents || stats.events <= maxEvents);
+    }
+};
+
+struct BudgetFit {
+    bool fits = false;
+    ChatParams params;             // the config to write with
+    int coalesceInterval = 0;      // ms, 0 when batches were not coalesced
+    std::shared_ptr<const std::vector<Batch> > batches; // the batches to write
+    SubtitleStats configured;      // the output as configured
+    SubtitleStats predicted;       // the output as chosen; without a fit, the smallest one tried
+    size_t tries = 0;              // outputs measured
+
+    // What was changed, "as configured" for nothing.
+    std::string describe(const ChatParams &original) const {
+        std::string steps;
+        auto add = [&](const std::string &step) { steps += (steps.empty() ? "" : ", ") + step; };
+        if (params.compactOutput && !original.compactOutput) add("compact output");
+        if (coalesceInterval) add(std::format("batches coalesced within {} ms", coalesceInterval));
+        if (params.maxPens != original.maxPens) add(std::format("at most {} username pens", params.maxPens));
+        return steps.empty() ? "as configured" : steps;
+    }
+};
+
+using EmitterFactory = std::function<std::unique_ptr<SubtitleEmitter>(const ChatParams &)>;
+
+inline SubtitleStats measureOutput(SubtitleEmitter &emitter, const std::vector<Batch> &batches) {
+    TraceScope trace("measureOutput", static_cast<int64_t>(batches.size()));
+    DiscardBuffer discard;
+    std::ostream sink(&discard);
+    BufferedWriter writer(&sink);
+    SubtitleStats stats;
+    writeSubtitles(emitter, writer, batches, &stats);
+    return stats;
+}
+
+// Lossy combinations are tried by the number of steps taken, fewest first; at equal count pen
+// steps go first, as merging similar username colors is harder to notice than messages showing
+// early. Sizes are exact, so the first combination that fits is the one written.
+inline BudgetFit fitBudget(const std::shared_ptr<const std::vector<Batch> > &batches, const ChatParams &params,
+                           const OutputBudget &budget, const EmitterFactory &makeEmitter) {
+    BudgetFit fit;
+    fit.params = params;
+    fit.batches = batches;
+    auto measure = [&](const ChatParams &candidate, const std::vector<Batch> &candidateBatches) {
+        fit.tries++;
+        auto emitter = makeEmitter(candidate);
+        return measureOutput(*emitter, candidateBatches);
+    };
+    fit.configured = fit.predicted = measure(params, *batches);
+    if (budget.fits(fit.predicted)) {
+        fit.fits = true;
+        return fit;
+    }
+
+    ChatParams compact = params;
+    compact.compactOutput = true;
+    if (!params.compactOutput) {
+        fit.params = compact;
+        fit.predicted = measure(compact, *batches);
+        if (budget.fits(fit.predicted)) {
+            fit.fits = true;
+            return fit;
+        }
+    }
+
+    std::vector<int> intervals = {0};
+    for (int interval: budget.coalesceIntervals) {
+        if (interval > intervals.back()) intervals.push_back(interval);
+    }
+    std::vector<int> pens = {params.maxPens};
+    for (int limit: budget.penLimits) {
+        if (limit > 0 && (pens.back() == 0 || limit < pens.back())) pens.push_back(limit);
+    }
+    for (size_t steps = 1; steps + 2 <= intervals.size() + pens.size(); ++steps) {
+        for (size_t coalesce = 0; coalesce <= steps; ++coalesce) {
+            size_t pen = steps - coalesce;
+            if (coalesce >= intervals.size() || pen >= pens.size()) continue;
+            ChatParams candidate = compact;
+            candidate.maxPens = pens[pen];
+            auto candidateBatches = coalesce ? std::make_shared<const std::vector<Batch> >(
+                                                   coalesceBatches(*batches, intervals[coalesce]))
+                                             : batches;
+            SubtitleStats stats = measure(candidate, *candidateBatches);
+            bool fits = budget.fits(stats);
+            if (fits || stats.bytes < fit.predicted.bytes ||
+                (stats.bytes == fit.predicted.bytes && stats.events < fit.predicted.events)) {
+                fit.params = candidate;
+                fit.coalesceInterval = intervals[coalesce];
+                fit.batches = std::move(candidateBatches);
+                fit.predicted = stats;
+            }
+            if (fits) {
+                fit.fits = true;
+                return fit;
+            }
+        }
+    }
+    return fit;
+}
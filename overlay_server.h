@@ -0,0 +1,345 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "subtitle_writers.h"
+
+// Serves the live chat window to browser sources such as OBS, on 127.0.0.1 only (POSIX only).
+//   GET /        an overlay page placing the lines like the ASS output, styled from ChatParams
+//   GET /events  Server-Sent Events the page renders
+// Every batch of the ChatBatcher is sent the moment it starts, as the lines new since the last one:
+//   event: batch
+//   data: {"time":4000,"first":17,"from":25,"lines":[{"user":"name","color":"#FF0000","text":": hi"},{"text":"..."}]}
+// "first" is the sequence number of the oldest line in the window and "from" that of the first line
+// listed; continuation lines of a message have no user. A new client gets the whole window first.
+class OverlayServer {
+public:
+    OverlayServer(uint16_t port, const ChatParams &params) : params(params), batcher(params.totalDisplayLines) {
+#if defined(_WIN32)
+        throw std::runtime_error("The overlay server is not supported on this platform");
+#else
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0) throw std::runtime_error("Cannot create the overlay server socket");
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t length = sizeof(address);
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listenFd, 16) != 0 ||
+            getsockname(listenFd, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+            ::close(listenFd);
+            throw std::runtime_error("Cannot listen on 127.0.0.1:" + std::to_string(port));
+        }
+        boundPort = ntohs(address.sin_port);
+        setNonBlocking(listenFd);
+        pageHtml = overlayPage(params);
+        thread = std::jthread([this](std::stop_token stop) { serve(stop); });
+#endif
+    }
+
+    OverlayServer(const OverlayServer &) = delete;
+
+    OverlayServer &operator=(const OverlayServer &) = delete;
+
+    ~OverlayServer() {
+#if !defined(_WIN32)
+        thread.request_stop();
+        if (thread.joinable()) thread.join();
+        for (auto &client: clients) ::close(client.fd);
+        ::close(listenFd);
+#endif
+    }
+
+    // Messages are expected in time order, from one thread.
+    void push(const ChatMessage &message) {
+        WrappedMessage wrapped = wrapChatMessage(message, params);
+        if (wrapped.lines.empty()) return;
+        const Batch *batch = batcher.push(wrapped);
+        if (!batch) return;
+        std::string event = batchEvent(*batch, std::max(sentLines, batch->firstLine));
+        sentLines = batch->firstLine + batch->lines.size();
+
+        std::lock_guard lock(mutex);
+        current = *batch;
+        for (auto &client: clients) {
+            if (client.subscribed) send(client, event);
+        }
+    }
+
+    uint16_t port() const {
+        return boundPort;
+    }
+
+private:
+    struct Client {
+        int fd = -1;
+        std::string request;
+        std::string pending;          // not yet accepted by the socket
+        bool subscribed = false;      // receives the event stream
+        bool closeWhenSent = false;
+        bool closed = false;
+    };
+
+    // A client this far behind is dropped; its EventSource reconnects and gets the current window.
+    static constexpr size_t maxPending = 4 << 20;
+    static constexpr size_t maxRequest = 8 << 10;
+
+    static std::string batchEvent(const Batch &batch, uint64_t from) {
+        BufferedWriter out;
+        out.write("event: batch\ndata: {\"time\":");
+        out.integer(batch.time);
+        out.write(",\"first\":");
+        out.integer(static_cast<long long>(batch.firstLine));
+        out.write(",\"from\":");
+        out.integer(static_cast<long long>(from));
+        out.write(",\"lines\":[");
+        for (uint64_t id = from; id < batch.firstLine + batch.lines.size(); ++id) {
+            const ChatLine &line = batch.lines[id - batch.firstLine];
+            out.write(id == from ? "{" : ",{");
+            if (line.user) {
+                out.write("\"user\":\"");
+                writeJsonEscaped(out, line.user->name);
+                out.write("\",\"color\":\"");
+                out.write(line.user->color.toHexString());
+                out.write("\",");
+            }
+            out.write("\"text\":\"");
+            writeJsonEscaped(out, line.text);
+            out.write("\"}");
+        }
+        out.write("]}\n\n");
+        return std::move(out.str());
+    }
+
+    // Positions and sizes are the ASS ones for a 100x100 video, in vw and vh.
+    static std::string overlayPage(const ChatParams &params) {
+        static constexpr std::array<std::string_view, 8> fonts = {
+            "sans-serif", "'Courier New', monospace", "'Times New Roman', serif", "'Lucida Console', monospace",
+            "Roboto, Arial, sans-serif", "'Comic Sans MS', cursive", "'Monotype Corsiva', cursive", "Arial, sans-serif"
+        };
+        const std::string edge = params.textEdgeColor.toHexString();
+        std::string shadow;
+        switch (params.textEdgeType) {
+            case EdgeType::None: shadow = "none";
+                break;
+            case EdgeType::HardShadow: shadow = "0.06em 0.06em 0 " + edge;
+                break;
+            case EdgeType::Bevel: shadow = "0.04em 0.04em 0 " + edge + ", -0.04em -0.04em 0 " + edge;
+                break;
+            case EdgeType::GlowOutline: shadow = "0 0 0.08em " + edge + ", 0 0 0.08em " + edge + ", 0 0 0.08em " + edge;
+                break;
+            case EdgeType::SoftShadow: shadow = "0.06em 0.06em 0.12em " + edge;
+                break;
+        }
+
+        BufferedWriter out;
+        out.write("<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>SubChat overlay</title>\n"
+            "<style>\n"
+            "html, body { margin: 0; overflow: hidden; background: transparent; }\n"
+            ".line { position: absolute; white-space: pre; line-height: 1; left: ");
+        out.fixed(assX(params.horizontalMargin, params.fontSizePercent, 100), 3);
+        out.write("vw; font-size: ");
+        out.fixed(assFontSize(params.fontSizePercent, 100), 3);
+        out.write("vh;\n  font-family: ");
+        out.write(fonts[std::min(static_cast<size_t>(params.fontStyle), fonts.size() - 1)]);
+        out.write(";");
+        if (params.fontStyle == FontStyle::SmallCapitals) out.write(" font-variant: small-caps;");
+        if (params.textBold) out.write(" font-weight: bold;");
+        if (params.textItalic) out.write(" font-style: italic;");
+        if (params.textUnderline) out.write(" text-decoration: underline;");
+        out.write("\n  color: ");
+        out.write(params.textForegroundColor.toHexString());
+        out.write("; background: ");
+        out.write(params.textBackgroundColor.toHexString());
+        out.write("; text-shadow: ");
+        out.write(shadow);
+        out.write("; }\n</style>\n</head>\n<body>\n<script>\nconst slots = [");
+        for (int idx = 0; idx < std::max(params.totalDisplayLines, 0); ++idx) {
+            if (idx) out.put(',');
+            out.fixed(params.verticalSpacing < 0
+                          ? assY(params.verticalMargin, params.fontSizePercent, 100, idx)
+                          : assY(params.verticalMargin + params.verticalSpacing * idx, params.fontSizePercent, 100), 3);
+        }
+        out.write("];\nconst paged = ");
+        out.write(params.verticalSpacing != -1 && params.layout == ChatLayout::Page ? "true" : "false");
+        out.write(R"(;
+let shown = [];  // {id, element} in slot order
+let placed = 0;  // sequence number after the newest line shown
+
+function lineElement(line) {
+    const element = document.createElement('div');
+    element.className = 'line';
+    if (line.user) {
+        const user = document.createElement('span');
+        user.style.color = line.color;
+        user.textContent = line.user;
+        element.append(user);
+    }
+    element.append(line.text);
+    document.body.append(element);
+    return element;
+}
+
+const events = new EventSource('/events');
+// Every (re)connection starts with the whole window.
+events.addEventListener('open', () => {
+    shown.splice(0).forEach(l => l.element.remove());
+    placed = 0;
+});
+events.addEventListener('batch', event => {
+    const batch = JSON.parse(event.data);
+    const added = batch.lines.map((line, i) => ({id: batch.from + i, line})).filter(l => l.id >= placed);
+    if (paged) {
+        if (shown.length + added.length > slots.length) shown.splice(0).forEach(l => l.element.remove());
+    } else {
+        shown = shown.filter(l => l.id >= batch.first || l.element.remove());
+    }
+    for (const {id, line} of added) shown.push({id, element: lineElement(line)});
+    placed = batch.from + batch.lines.length;
+    shown.forEach((l, slot) => l.element.style.top = slots[slot] + 'vh');
+});
+</script>
+</body>
+</html>
+)");
+        return std::move(out.str());
+    }
+
+#if !defined(_WIN32)
+#if defined(MSG_NOSIGNAL)
+    static constexpr int sendFlags = MSG_NOSIGNAL;
+#else
+    static constexpr int sendFlags = 0;
+#endif
+
+    static void setNonBlocking(int fd) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    // Called with mutex held.
+    void send(Client &client, std::string_view data) {
+        if (client.closed) return;
+        client.pending.append(data);
+        flush(client);
+        if (client.pending.size() > maxPending) client.closed = true;
+    }
+
+    void flush(Client &client) {
+        size_t sent = 0;
+        while (sent < client.pending.size()) {
+            ssize_t count = ::send(client.fd, client.pending.data() + sent, client.pending.size() - sent,
+                                   sendFlags | MSG_DONTWAIT);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+            if (count <= 0) {
+                client.closed = true;
+                break;
+            }
+            sent += static_cast<size_t>(count);
+        }
+        client.pending.erase(0, sent);
+        if (client.pending.empty() && client.closeWhenSent) client.closed = true;
+    }
+
+    void respond(Client &client) {
+        std::string_view request = client.request;
+        std::string_view method = request.substr(0, request.find(' '));
+        std::string_view path = request.substr(std::min(method.size() + 1, request.size()));
+        path = path.substr(0, std::min(path.find(' '), path.find('?')));
+
+        if (method == "GET" && path == "/events") {
+            client.subscribed = true;
+            send(client, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/event-stream\r\n"
+                 "Cache-Control: no-cache\r\n"
+                 "\r\n"
+                 "retry: 1000\n\n");
+            if (current) send(client, batchEvent(*current, current->firstLine));
+            return;
+        }
+        client.closeWhenSent = true;
+        if (method == "GET" && (path == "/" || path == "/index.html")) {
+            send(client, "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: " +
+                         std::to_string(pageHtml.size()) + "\r\nConnection: close\r\n\r\n" + pageHtml);
+        } else {
+            send(client, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        }
+    }
+
+    void serve(std::stop_token stop) {
+        auto lastHeartbeat = std::chrono::steady_clock::now();
+        std::vector<pollfd> fds;
+        while (!stop.stop_requested()) {
+            fds.assign(1, pollfd{listenFd, POLLIN, 0});
+            {
+                std::lock_guard lock(mutex);
+                for (const auto &client: clients) {
+                    fds.push_back({client.fd, static_cast<short>(POLLIN | (client.pending.empty() ? 0 : POLLOUT)), 0});
+                }
+            }
+            if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) break;
+
+            std::lock_guard lock(mutex);
+            // Only this thread adds and removes clients, so fds[i + 1] still belongs to clients[i].
+            for (size_t i = 0; i + 1 < fds.size(); ++i) {
+                Client &client = clients[i];
+                short events = fds[i + 1].revents;
+                if (events & POLLOUT) flush(client);
+                if (events & (POLLERR | POLLHUP | POLLNVAL)) client.closed = true;
+                if (!(events & POLLIN) || client.closed) continue;
+                char chunk[4096];
+                ssize_t count = recv(client.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (count <= 0) {
+                    if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) client.closed = true;
+                    continue;
+                }
+                if (client.subscribed || client.closeWhenSent) continue;
+                client.request.append(chunk, static_cast<size_t>(count));
+                if (client.request.find("\r\n\r\n") != std::string::npos) respond(client);
+                else if (client.request.size() > maxRequest) client.closed = true;
+            }
+            if (fds[0].revents & POLLIN) {
+                for (int fd; (fd = accept(listenFd, nullptr, nullptr)) >= 0;) {
+                    setNonBlocking(fd);
+                    clients.emplace_back().fd = fd;
+                }
+            }
+            // Comments keep idle connections from being timed out by the browser source.
+            if (std::chrono::steady_clock::now() - lastHeartbeat > std::chrono::seconds(15)) {
+                lastHeartbeat = std::chrono::steady_clock::now();
+                for (auto &client: clients) {
+                    if (client.subscribed) send(client, ":\n\n");
+                }
+            }
+            std::erase_if(clients, [](const Client &client) {
+                if (client.closed) ::close(client.fd);
+                return client.closed;
+            });
+        }
+    }
+
+    int listenFd = -1;
+    std::jthread thread;
+#endif
+    ChatParams params;
+    ChatBatcher batcher;
+    uint64_t sentLines = 0;
+    uint16_t boundPort = 0;
+    std::string pageHtml;
+    std::mutex mutex;
+    std::vector<Client> clients;
+    std::optional<Batch> current;
+};
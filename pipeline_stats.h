@@ -0,0 +1,199 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+// CPU time used so far by the calling thread, in seconds.
+inline double threadCpuSeconds() {
+#if defined(_WIN32)
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+    auto ticks = [](const FILETIME &t) { return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return static_cast<double>(ticks(kernel) + ticks(user)) / 1e7;
+#else
+    timespec now{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+#endif
+}
+
+// CPU time used so far by the whole process, in seconds.
+inline double processCpuSeconds() {
+#if defined(_WIN32)
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+    auto ticks = [](const FILETIME &t) { return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return static_cast<double>(ticks(kernel) + ticks(user)) / 1e7;
+#else
+    timespec now{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+#endif
+}
+
+// Peak resident set size of the process in bytes, 0 when unknown.
+inline uint64_t peakRssBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+enum class Stage {
+    Parse, Wrap, Batch, Serialize, Write
+};
+
+inline constexpr std::array<std::string_view, 5> stageNames = {"parse", "wrap", "batch", "serialize", "write"};
+
+// Wall and CPU time spent in a stage, summed over every time it ran.
+struct StageTime {
+    double wall = 0;
+    double cpu = 0;
+    size_t runs = 0;
+
+    StageTime &operator+=(const StageTime &other) {
+        wall += other.wall;
+        cpu += other.cpu;
+        runs += other.runs;
+        return *this;
+    }
+
+    StageTime &operator-=(const StageTime &other) {
+        wall -= other.wall;
+        cpu -= other.cpu;
+        return *this;
+    }
+};
+
+// Measures one run of a stage on the calling thread.
+class StageClock {
+public:
+    StageClock() : wallStart(std::chrono::steady_clock::now()), cpuStart(threadCpuSeconds()) {
+    }
+
+    StageTime elapsed() const {
+        return {std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count(),
+                threadCpuSeconds() - cpuStart, 1};
+    }
+
+private:
+    std::chrono::steady_clock::time_point wallStart;
+    double cpuStart;
+};
+
+// What --stats reports. Every part of the pipeline takes a pointer that is null when the flag is
+// off, so measuring costs one branch per stage, not per message.
+class PipelineStats {
+public:
+    PipelineStats() : wallStart(std::chrono::steady_clock::now()), cpuStart(processCpuSeconds()) {
+    }
+
+    void add(Stage stage, const StageTime &time) {
+        std::lock_guard lock(mutex);
+        stages[static_cast<size_t>(stage)] += time;
+    }
+
+    // Summed over conversions; lines and batches once per distinct layout.
+    std::atomic<uint64_t> messages = 0;
+    std::atomic<uint64_t> lines = 0;
+    std::atomic<uint64_t> batches = 0;
+    std::atomic<uint64_t> events = 0;
+    std::atomic<uint64_t> pens = 0;
+    std::atomic<uint64_t> inputBytes = 0;
+    std::atomic<uint64_t> outputBytes = 0;
+
+    void print(std::ostream &out) {
+        finish();
+        std::lock_guard lock(mutex);
+        out << std::format("{:<10} {:>10} {:>10} {:>6}\n", "stage", "wall ms", "cpu ms", "runs");
+        for (size_t i = 0; i < stages.size(); ++i) {
+            out << std::format("{:<10} {:>10.2f} {:>10.2f} {:>6}\n", stageNames[i], stages[i].wall * 1000,
+                               stages[i].cpu * 1000, stages[i].runs);
+        }
+        out << std::format("{:<10} {:>10.2f} {:>10.2f}\n", "total", total.wall * 1000, total.cpu * 1000);
+        out << std::format("Messages: {}, lines: {}, batches: {}, events: {}, pens: {}\n",
+                           messages.load(), lines.load(), batches.load(), events.load(), pens.load());
+        out << std::format("Input: {:.2f} MB, output: {:.2f} MB, peak RSS: {:.1f} MB\n",
+                           inputBytes / 1e6, outputBytes / 1e6, peakRss / 1e6);
+        out << std::format("Throughput: {:.0f} messages/s, {:.2f} MB/s in, {:.2f} MB/s out\n",
+                           perSecond(messages), perSecond(inputBytes) / 1e6, perSecond(outputBytes) / 1e6);
+    }
+
+    void printJson(std::ostream &out) {
+        finish();
+        std::lock_guard lock(mutex);
+        out << "{\"stages\":{";
+        for (size_t i = 0; i < stages.size(); ++i) {
+            out << std::format("{}\"{}\":{{\"wall_ms\":{:.3f},\"cpu_ms\":{:.3f},\"runs\":{}}}", i ? "," : "",
+                               stageNames[i], stages[i].wall * 1000, stages[i].cpu * 1000, stages[i].runs);
+        }
+        out << std::format("}},\"wall_ms\":{:.3f},\"cpu_ms\":{:.3f}", total.wall * 1000, total.cpu * 1000);
+        out << std::format(",\"messages\":{},\"lines\":{},\"batches\":{},\"events\":{},\"pens\":{}",
+                           messages.load(), lines.load(), batches.load(), events.load(), pens.load());
+        out << std::format(",\"input_bytes\":{},\"output_bytes\":{},\"peak_rss_bytes\":{}",
+                           inputBytes.load(), outputBytes.load(), peakRss);
+        out << std::format(",\"messages_per_second\":{:.1f},\"input_mb_per_second\":{:.3f},"
+                           "\"output_mb_per_second\":{:.3f}}}\n",
+                           perSecond(messages), perSecond(inputBytes) / 1e6, perSecond(outputBytes) / 1e6);
+    }
+
+private:
+    // The totals end with the first report.
+    void finish() {
+        std::lock_guard lock(mutex);
+        if (total.runs) return;
+        total = {std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count(),
+                 processCpuSeconds() - cpuStart, 1};
+        peakRss = peakRssBytes();
+    }
+
+    double perSecond(uint64_t value) const {
+        return total.wall > 0 ? static_cast<double>(value) / total.wall : 0;
+    }
+
+    std::mutex mutex;
+    std::array<StageTime, stageNames.size()> stages{};
+    StageTime total;
+    uint64_t peakRss = 0;
+    std::chrono::steady_clock::time_point wallStart;
+    double cpuStart;
+};
+
+// Runs step and, when stats is not null, adds its time to stage.
+template<typename Step>
+auto timeStage(PipelineStats *stats, Stage stage, Step &&step) {
+    if (!stats) return step();
+    StageClock clock;
+    auto result = step();
+    stats->add(stage, clock.elapsed());
+    return result;
+}
@@ -0,0 +1,1049 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <memory>
+#include <string_view>
+#include <format>
+
+#include "ytt_generator.h"
+#include "pipeline_stats.h"
+
+inline float realFontScale(int yttFontSize) {
+    return static_cast<float>((100.0 + (yttFontSize - 100.0) / 4.0) / 100.0);
+}
+
+
+inline double assFontSize(const int yttFontSize, const int assHeight) {
+    return (realFontScale(yttFontSize) * 64.107) / 1440.0 * static_cast<double>(assHeight);
+}
+
+inline double assX(int yttX, const int yttFontSize, const int assWidth) {
+    return (51.2821 + 24.5844 * yttX + 15.9109 * realFontScale(yttFontSize)) * assWidth / 2560.0;
+}
+
+inline double assY(const int yttY, const int yttFontSize, const int assHeight, const uint32_t line = 0) {
+    //     double rFontScale = realFontScale(yttFontSize);
+    //
+    // //    double lC = 3.4442 * rFontScale * rFontScale * rFontScale
+    // //                - 8.3489 * rFontScale * rFontScale
+    // //                + 74.5018 * rFontScale - 1.6156;
+    // //    double lC = 3.4441851202 * rFontScale * rFontScale * rFontScale
+    // //                - 8.3488610000 * rFontScale * rFontScale
+    // //                + 74.5018286601 * rFontScale - 1.6155972200;
+    //     double lC = 5.1862772740 * rFontScale * rFontScale * rFontScale
+    //                 - 14.1350956536 * rFontScale * rFontScale
+    //                 + 80.4294668977 * rFontScale - 3.3718297322;
+    const int yttY2 = yttY * yttY;
+    const int yttY3 = yttY2 * yttY;
+    const double fScale = realFontScale(yttFontSize);
+    const double fScale2 = fScale * fScale;
+
+    return ((0.0000036448 * fScale - 0.0000102298) * yttY3 +
+            (0.0001228929 * fScale + 0.0006313481) * yttY2 +
+            (-0.0299080260 * fScale + 13.8373127706) * yttY +
+            (2.3156363636 * fScale2 - 2.1625454545 * fScale + 30.1938181818) +
+            (2.095321207 * fScale2 + 64.752581827 * fScale + 1.158860604) * line
+           ) * assHeight / 1440.0;
+}
+
+
+// Collects output in a buffer and hands it to the stream in large chunks.
+// Without a stream everything is kept in memory and can be taken with str().
+// A writer is not shared between threads, every conversion owns its own.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(std::ostream *out = nullptr, size_t capacity = 1 << 16)
+        : out(out), capacity(capacity) {
+        buffer.reserve(out ? capacity + capacity / 4 : capacity);
+    }
+
+    BufferedWriter(const BufferedWriter &) = delete;
+
+    BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+    ~BufferedWriter() {
+        flush();
+    }
+
+    void write(std::string_view s) {
+        buffer.append(s);
+        flushIfFull();
+    }
+
+    void put(char c) {
+        buffer.push_back(c);
+        flushIfFull();
+    }
+
+    // Numbers go through to_chars, which is locale independent and needs no temporary string.
+    void integer(long long value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        write(std::string_view(digits, result.ptr - digits));
+    }
+
+    void fixed(double value, int precision) {
+        char digits[64];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed, precision);
+        write(std::string_view(digits, result.ptr - digits));
+    }
+
+    template<typename... Args>
+    void format(std::format_string<Args...> fmt, Args &&... args) {
+        std::format_to(std::back_inserter(buffer), fmt, std::forward<Args>(args)...);
+        flushIfFull();
+    }
+
+    void flush() {
+        if (!out || buffer.empty()) return;
+        TraceScope trace("flush", static_cast<int64_t>(buffer.size()));
+        if (flushTime) {
+            StageClock clock;
+            out->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            *flushTime += clock.elapsed();
+        } else {
+            out->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        }
+        flushed += buffer.size();
+        buffer.clear();
+    }
+
+    // Adds the time spent handing data to the stream to time (--stats).
+    void timeFlushes(StageTime *time) {
+        flushTime = time;
+    }
+
+    // Total number of bytes written so far, flushed or not.
+    size_t size() const {
+        return flushed + buffer.size();
+    }
+
+    std::string &str() {
+        return buffer;
+    }
+
+private:
+    void flushIfFull() {
+        if (out && buffer.size() >= capacity) flush();
+    }
+
+    std::ostream *out;
+    size_t capacity;
+    size_t flushed = 0;
+    std::string buffer;
+    StageTime *flushTime = nullptr;
+};
+
+// Swallows what it is given, for writers that only need the size of a document.
+class DiscardBuffer : public std::streambuf {
+protected:
+    std::streamsize xsputn(const char *, std::streamsize count) override {
+        return count;
+    }
+
+    int overflow(int c) override {
+        return c;
+    }
+};
+
+// Writes value with at least two digits.
+inline void writeTwoDigits(BufferedWriter &out, uint64_t value) {
+    if (value < 10) out.put('0');
+    out.integer(static_cast<long long>(value));
+}
+
+// ASS time, H:MM:SS.cc
+inline void writeAssTime(BufferedWriter &out, uint64_t ms) {
+    uint64_t total = ms / 10;
+    out.integer(static_cast<long long>(total / 360000));
+    out.put(':');
+    writeTwoDigits(out, (total / 6000) % 60);
+    out.put(':');
+    writeTwoDigits(out, (total / 100) % 60);
+    out.put('.');
+    writeTwoDigits(out, total % 100);
+}
+
+// SRT and WebVTT time, HH:MM:SS,mmm (WebVTT separates the milliseconds with a dot).
+inline void writeClockTime(BufferedWriter &out, uint64_t ms, char fractionSeparator) {
+    writeTwoDigits(out, ms / 3600000);
+    out.put(':');
+    writeTwoDigits(out, (ms / 60000) % 60);
+    out.put(':');
+    writeTwoDigits(out, (ms / 1000) % 60);
+    out.put(fractionSeparator);
+    uint64_t millis = ms % 1000;
+    if (millis < 100) out.put('0');
+    writeTwoDigits(out, millis);
+}
+
+// Copies raw into out, replacing the characters escape() returns a replacement for.
+// Runs of plain text are copied at once.
+template<typename Escape>
+void writeEscaped(BufferedWriter &out, std::string_view raw, Escape &&escape) {
+    size_t runStart = 0;
+    for (size_t i = 0; i < raw.size(); ++i) {
+        std::string_view escaped = escape(raw[i]);
+        if (escaped.empty()) continue;
+        out.write(raw.substr(runStart, i - runStart));
+        out.write(escaped);
+        runStart = i + 1;
+    }
+    out.write(raw.substr(runStart));
+}
+
+// XML text and attribute values (quotes are only escaped inside attributes), also used for WebVTT
+// and SubRip.
+inline void writeXmlEscaped(BufferedWriter &out, std::string_view raw, bool attribute = false) {
+    writeEscaped(out, raw, [attribute](char c) -> std::string_view {
+        switch (c) {
+            case '&': return "&amp;";
+            case '<': return "&lt;";
+            case '>': return "&gt;";
+            case '"': return attribute ? "&quot;" : "";
+            case '\'': return attribute ? "&apos;" : "";
+            default: return {};
+        }
+    });
+}
+
+inline void writeAssEscaped(BufferedWriter &out, std::string_view raw) {
+    writeEscaped(out, raw, [](char c) -> std::string_view {
+        switch (c) {
+            case '\\': return "\\\\";
+            case '{': return "\\{";
+            case '}': return "\\}";
+            case '\n': return "\\n";
+            //TODO Improve this
+            default: return {};
+        }
+    });
+}
+
+// JSON string contents, without the surrounding quotes.
+inline void writeJsonEscaped(BufferedWriter &out, std::string_view raw) {
+    static const auto controls = [] {
+        std::array<std::string, 0x20> table;
+        for (size_t c = 0; c < table.size(); ++c) table[c] = std::format("\\u{:04x}", c);
+        return table;
+    }();
+    writeEscaped(out, raw, [](char c) -> std::string_view {
+        switch (c) {
+            case '"': return "\\\"";
+            case '\\': return "\\\\";
+            case '\n': return "\\n";
+            default: {
+                auto byte = static_cast<unsigned char>(c);
+                return byte < controls.size() ? std::string_view(controls[byte]) : std::string_view();
+            }
+        }
+    });
+}
+
+// Numbers describing a generated subtitle file.
+struct SubtitleStats {
+    size_t distinctColors = 0; // distinct username colors in the chat
+    size_t pens = 0;           // palette entries (SRV3 pens, ASS styles, ...), including the one for message text
+    size_t events = 0;         // paragraphs, dialogue lines or cues
+    size_t bytes = 0;          // size of the serialized document
+};
+
+// Copies from into to, reusing the string buffers to already has. The username moves between
+// to.user and spareUser, so its buffer is kept while to has no user.
+inline void copyLineInto(ChatLine &to, const ChatLine &from, User &spareUser) {
+    to.text = from.text;
+    if (from.user) {
+        if (!to.user) to.user.emplace(std::move(spareUser));
+        *to.user = *from.user;
+    } else if (to.user) {
+        spareUser = std::move(*to.user);
+        to.user.reset();
+    }
+}
+
+// A wrapped line that stays in one window slot for a period of time.
+struct LineSpan {
+    const ChatLine *line;
+    uint64_t id; // sequence number of the line, see Batch::firstLine
+    int start;
+    int end;
+    int slot;
+};
+
+// Turns the batch stream into LineSpans as soon as they are final.
+// Scroll layout: every line is shown in its current slot from one batch to the next.
+// Page layout: every new line takes the next free slot and keeps it for its whole lifetime.
+// When the lines of a batch no longer fit, the page is cleared and filling restarts at the top.
+// Page lines are copied, so the batches do not have to outlive the call that fed them.
+class LineSpanTracker {
+public:
+    explicit LineSpanTracker(const ChatParams &params)
+        : paged(params.verticalSpacing != -1 && params.layout == ChatLayout::Page),
+          maxLines(static_cast<size_t>(std::max(params.totalDisplayLines, 0))) {
+    }
+
+    // Calls emit(const LineSpan &) for every span that ended up to this batch.
+    template<typename Emit>
+    void batch(const Batch &batch, int endTime, Emit &&emit) {
+        lastEnd = endTime;
+        if (!paged) {
+            for (size_t idx = 0; idx < batch.lines.size(); ++idx) {
+                emit(LineSpan{&batch.lines[idx], batch.firstLine + idx, batch.time, endTime, static_cast<int>(idx)});
+            }
+            return;
+        }
+        uint64_t batchEnd = batch.firstLine + batch.lines.size();
+        uint64_t newFrom = std::max(placedLines, batch.firstLine);
+        placedLines = std::max(placedLines, batchEnd);
+        if (newFrom >= batchEnd) return;
+
+        if (pageSize + (batchEnd - newFrom) > maxLines) clearPage(batch.time, emit);
+        for (uint64_t id = newFrom; id < batchEnd; ++id) {
+            place(batch.lines[id - batch.firstLine], id, batch.time);
+        }
+    }
+
+    // Ends the lines still on the page at the end of the last batch.
+    // Like the scrolling output, lines that first appear in the final batch are not shown.
+    template<typename Emit>
+    void finish(Emit &&emit) {
+        clearPage(lastEnd, emit);
+    }
+
+private:
+    struct PlacedLine {
+        ChatLine line;
+        uint64_t id;
+        int start;
+        User spareUser;
+    };
+
+    // Slots keep their strings when the page is cleared and are assigned over, so once they grew to
+    // the longest lines, placing a line does not allocate.
+    void place(const ChatLine &line, uint64_t id, int start) {
+        if (pageSize == page.size()) page.emplace_back();
+        PlacedLine &placed = page[pageSize++];
+        copyLineInto(placed.line, line, placed.spareUser);
+        placed.id = id;
+        placed.start = start;
+    }
+
+    template<typename Emit>
+    void clearPage(int time, Emit &emit) {
+        for (size_t slot = 0; slot < pageSize; ++slot) {
+            emit(LineSpan{&page[slot].line, page[slot].id, page[slot].start, time, static_cast<int>(slot)});
+        }
+        pageSize = 0;
+    }
+
+    bool paged;
+    size_t maxLines;
+    int lastEnd = 0;
+    uint64_t placedLines = 0;
+    std::vector<PlacedLine> page; // the first pageSize are on the page
+    size_t pageSize = 0;
+};
+
+// One output format. The emitter is fed the batch stream: begin() once, batch() for every batch
+// with the time the next one starts, end() once.
+class SubtitleEmitter {
+public:
+    explicit SubtitleEmitter(const ChatParams &params) : params(params) {
+    }
+
+    virtual ~SubtitleEmitter() = default;
+
+    // userColors are the distinct username colors of all batches.
+    virtual void begin(BufferedWriter &out, const std::vector<Color> &userColors) = 0;
+
+    virtual void batch(BufferedWriter &out, const Batch &batch, int endTime) = 0;
+
+    virtual void end(BufferedWriter &out) = 0;
+
+    // The closing part end() finishes the document with, written without ending anything.
+    // Live output writes it after every update and overwrites it with the next one.
+    virtual void footer(BufferedWriter &) const {
+    }
+
+    // What a palette entry is called in this format.
+    virtual std::string_view paletteName() const = 0;
+
+    size_t events() const {
+        return eventCount;
+    }
+
+    size_t paletteSize() const {
+        return paletteEntries;
+    }
+
+protected:
+    // Palette entry of a username color. Colors begin() was not told about (live input) take the
+    // entry of the nearest color it knows, which is remembered for the next time.
+    template<typename Entry>
+    static const Entry &paletteEntry(std::map<Color, Entry> &entries, const Color &color) {
+        auto it = entries.find(color);
+        if (it != entries.end() || entries.empty()) return entries[color];
+        LabColor lab = toOkLab(color);
+        auto nearest = std::ranges::min_element(entries, {}, [&](const auto &entry) {
+            return lab.distance2(toOkLab(entry.first));
+        });
+        return entries.emplace(color, nearest->second).first->second;
+    }
+
+    const ChatParams params;
+    size_t eventCount = 0;
+    size_t paletteEntries = 0;
+};
+
+// YouTube timed text. Written directly in the layout tinyxml2 used to print it.
+class Srv3Emitter : public SubtitleEmitter {
+public:
+    explicit Srv3Emitter(const ChatParams &params) : SubtitleEmitter(params), spans(params) {
+    }
+
+    std::string_view paletteName() const override {
+        return "pens";
+    }
+
+    void begin(BufferedWriter &out, const std::vector<Color> &userColors) override {
+        // Pick the colors that get a pen; with maxPens set, similar username colors share one.
+        auto palette = quantizeColors(userColors, std::max(params.maxPens, 0));
+        std::map<Color, std::string> pens;
+        pens[params.textForegroundColor] = "";
+        for (const auto &color: palette | std::views::values) pens[color] = "";
+
+        out.write("<timedtext format=\"3\">");
+        newLine(out, 1);
+        out.write("<head>");
+        // Create pen elements for each unique color.
+        int penIndex = 0;
+        std::string textEdgeType = enumToIntString(params.textEdgeType);
+        // The compact output numbers the default pen 0, every paragraph refers to it.
+        if (params.compactOutput) pens[params.textForegroundColor] = std::to_string(penIndex++);
+        for (auto &[color, id]: pens) {
+            if (id.empty()) id = std::to_string(penIndex++);
+            newLine(out, 2);
+            out.write("<pen");
+            writeAttribute(out, "id", id);
+            // b/i/u default to off, the compact output only writes them when set.
+            if (params.textBold || !params.compactOutput) writeAttribute(out, "b", params.textBold ? "1" : "0");
+            if (params.textItalic || !params.compactOutput) writeAttribute(out, "i", params.textItalic ? "1" : "0");
+            if (params.textUnderline || !params.compactOutput) writeAttribute(out, "u", params.textUnderline ? "1" : "0");
+            writeAttribute(out, "fc", color.toHexString());
+            writeAttribute(out, "fo", params.textForegroundColor.a);
+            writeAttribute(out, "bc", params.textBackgroundColor.toHexString());
+            writeAttribute(out, "bo", params.textBackgroundColor.a);
+            // Set edge attributes if provided.
+            if (!textEdgeType.empty()) {
+                writeAttribute(out, "ec", params.textEdgeColor.toHexString());
+                writeAttribute(out, "et", textEdgeType);
+            }
+            writeAttribute(out, "fs", enumToIntString(params.fontStyle));
+            writeAttribute(out, "sz", params.fontSizePercent);
+            out.write("/>");
+        }
+        defaultPen = pens[params.textForegroundColor];
+        for (const auto &color: userColors) userPens[color] = pens[palette[color]];
+        paletteEntries = pens.size();
+
+        // Create workspace element for whatever reason.
+        newLine(out, 2);
+        out.write("<ws id=\"1\"");
+        writeAttribute(out, "ju", enumToIntString(params.textAlignment));
+        out.write("/>");
+        // Create window position (wp) elements.
+        for (int i = 0; i < params.totalDisplayLines; ++i) {
+            newLine(out, 2);
+            out.write("<wp");
+            writeAttribute(out, "id", i);
+            out.write(" ap=\"0\""); // anchor point
+            writeAttribute(out, "ah", params.horizontalMargin);
+            writeAttribute(out, "av", i * params.verticalSpacing);
+            out.write("/>");
+        }
+        newLine(out, 1);
+        out.write("</head>");
+        newLine(out, 1);
+        // Left open: the first paragraph or end() closes the tag.
+        out.write("<body");
+    }
+
+    void batch(BufferedWriter &out, const Batch &batch, int endTime) override {
+        if (params.verticalSpacing != -1) {
+            spans.batch(batch, endTime, [&](const LineSpan &span) { writeLine(out, span); });
+            return;
+        }
+        // The whole window in one <p>, one line of text per chat line.
+        openParagraph(out, batch.time, endTime - batch.time, 0);
+        for (const auto &line: batch.lines) {
+            if (line.user) {
+                writeSpan(out, paletteEntry(userPens, line.user->color), line.user->name);
+                out.write(ZWSP);
+            }
+            writeSpan(out, defaultPen, line.text);
+            out.put('\n');
+        }
+        out.write("</p>");
+    }
+
+    void end(BufferedWriter &out) override {
+        if (params.verticalSpacing != -1) {
+            spans.finish([&](const LineSpan &span) { writeLine(out, span); });
+        }
+        footer(out);
+    }
+
+    void footer(BufferedWriter &out) const override {
+        if (bodyOpen) {
+            newLine(out, 1);
+            out.write("</body>");
+        } else {
+            out.write("/>");
+        }
+        newLine(out, 0);
+        out.write("</timedtext>");
+        if (!params.compactOutput) out.put('\n');
+    }
+
+private:
+    // Zero-width space (ZWSP) as a UTF-8 string.
+    static constexpr std::string_view ZWSP = "\xE2\x80\x8B";
+
+    // Element indentation; inside <p> whitespace would be rendered, so there is none.
+    void newLine(BufferedWriter &out, int depth) const {
+        if (params.compactOutput) return;
+        out.put('\n');
+        for (int i = 0; i < depth; ++i) out.write("    ");
+    }
+
+    static void writeAttribute(BufferedWriter &out, std::string_view name, std::string_view value) {
+        out.put(' ');
+        out.write(name);
+        out.write("=\"");
+        writeXmlEscaped(out, value, true);
+        out.put('"');
+    }
+
+    static void writeAttribute(BufferedWriter &out, std::string_view name, long long value) {
+        out.put(' ');
+        out.write(name);
+        out.write("=\"");
+        out.integer(value);
+        out.put('"');
+    }
+
+    static void writeSpan(BufferedWriter &out, std::string_view pen, std::string_view text) {
+        out.write("<s p=\"");
+        out.write(pen);
+        out.write("\">");
+        writeXmlEscaped(out, text);
+        out.write("</s>");
+    }
+
+    void openParagraph(BufferedWriter &out, int time, int duration, int slot) {
+        if (!bodyOpen) {
+            out.put('>');
+            bodyOpen = true;
+        }
+        newLine(out, 2);
+        out.write("<p t=\"");
+        out.integer(time);
+        out.write("\" d=\"");
+        out.integer(duration);
+        out.write("\" wp=\"");
+        out.integer(slot);
+        out.write("\" ws=\"1\" p=\"");
+        out.write(defaultPen);
+        out.write("\">");
+        eventCount++;
+    }
+
+    // One <p> per line, placed in its own window position.
+    void writeLine(BufferedWriter &out, const LineSpan &span) {
+        const ChatLine &line = *span.line;
+        openParagraph(out, span.start, span.end - span.start, span.slot);
+        if (params.compactOutput && !line.user) {
+            // Without a username span the text simply inherits the paragraph pen.
+            // After a username span it keeps its own pen: Android carries a span's color over to
+            // the next span that does not set one.
+            writeXmlEscaped(out, line.text);
+        } else {
+            if (line.user) {
+                writeSpan(out, paletteEntry(userPens, line.user->color), line.user->name);
+                out.write(ZWSP);
+            }
+            writeSpan(out, defaultPen, line.text);
+        }
+        out.write("</p>");
+    }
+
+    LineSpanTracker spans;
+    std::map<Color, std::string> userPens;
+    std::string defaultPen;
+    bool bodyOpen = false;
+};
+
+// Advanced SubStation Alpha script positioned like the YouTube output.
+class AssEmitter : public SubtitleEmitter {
+public:
+    AssEmitter(const ChatParams &params, int videoWidth, int videoHeight)
+        : SubtitleEmitter(params), spans(params), videoWidth(videoWidth), videoHeight(videoHeight) {
+        posX = assX(params.horizontalMargin, params.fontSizePercent, videoWidth);
+        size_t maxLines = std::max(params.totalDisplayLines, 0);
+        for (size_t idx = 0; idx < maxLines; ++idx) {
+            posY.push_back((params.verticalSpacing < 0)
+                               ? assY(params.verticalMargin, params.fontSizePercent, videoHeight, idx)
+                               : assY(params.verticalMargin + params.verticalSpacing * idx,
+                                      params.fontSizePercent, videoHeight));
+            BufferedWriter tag;
+            tag.write("{\\pos(");
+            tag.fixed(posX, 3);
+            tag.put(',');
+            tag.fixed(posY.back(), 3);
+            tag.write(")}");
+            posTags.push_back(std::move(tag.str()));
+        }
+    }
+
+    std::string_view paletteName() const override {
+        return "styles";
+    }
+
+    void begin(BufferedWriter &out, const std::vector<Color> &userColors) override {
+        static constexpr std::string_view header =
+                "\xEF\xBB\xBF" // BOM
+                "[Script Info]\n";
+        static constexpr std::string_view info =
+                "\n; Script generated by Kam1k4dze's SubChat\n"
+                "Title: SubChat preview\n"
+                "ScriptType: v4.00+\n"
+                "WrapStyle: 2\n"
+                "ScaledBorderAndShadow: yes\n"
+                "YCbCr Matrix: None\n";
+        static constexpr std::string_view stylesHeader =
+                "[V4+ Styles]\n"
+                "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, "
+                "Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, "
+                "Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding\n";
+        static constexpr std::string_view eventsHeader =
+                "[Events]\n"
+                "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n";
+
+        out.write(header);
+        out.write(info);
+        out.format("PlayResX: {}\nPlayResY: {}\nLayoutResX: {}\nLayoutResY: {}\n\n",
+                   videoWidth, videoHeight, videoWidth, videoHeight);
+        out.write(stylesHeader);
+        float fontSize = assFontSize(params.fontSizePercent, videoHeight);
+        // Colors live in the styles: Default for message text and one style per (quantized) username
+        // color, so events carry no color overrides. Alpha follows the former \a override, which was
+        // only written for colors that are not fully opaque.
+        auto writeStyle = [&](std::string_view name, const Color &color) {
+            int alpha = color.a == Color::maxValue ? 0 : static_cast<int>(color.a);
+            out.format(
+                "Style: {},Lucida Console,{:.2f},&H{:02X}{:02X}{:02X}{:02X},&H000000FF,&H{:02X}000000,&H{:02X}000000,"
+                "0,0,0,0,100,100,0,0,1,0,2.5,7,0,0,0,1\n",
+                name, fontSize, alpha, static_cast<int>(color.b), static_cast<int>(color.g), static_cast<int>(color.r), alpha, alpha
+            );
+        };
+        writeStyle("Default", params.textForegroundColor);
+
+        auto palette = quantizeColors(userColors, std::max(params.maxPens, 0));
+        std::map<Color, std::string> paletteStyles;
+        for (const auto &color: palette | std::views::values) paletteStyles[color] = "";
+        int styleIndex = 0;
+        for (auto &[color, name]: paletteStyles) {
+            name = "U" + std::to_string(styleIndex++);
+            writeStyle(name, color);
+        }
+        for (const auto &color: userColors) userStyles[color] = paletteStyles[palette[color]];
+        paletteEntries = paletteStyles.size() + 1;
+        out.put('\n');
+        out.write(eventsHeader);
+    }
+
+    void batch(BufferedWriter &out, const Batch &batch, int endTime) override {
+        spans.batch(batch, endTime, [&](const LineSpan &span) { addSpan(out, span); });
+        if (!params.assMoveScroll) return;
+        // Lines that were not carried past this batch have left the window. The others are
+        // compacted by swapping, which keeps every entry's buffers for the lines to come.
+        size_t kept = 0;
+        for (size_t idx = 0; idx < movingCount; ++idx) {
+            if (moving[idx].current.end <= batch.time) {
+                finishLine(out, moving[idx]);
+            } else {
+                if (idx != kept) std::swap(moving[kept], moving[idx]);
+                kept++;
+            }
+        }
+        movingCount = kept;
+    }
+
+    void end(BufferedWriter &out) override {
+        spans.finish([&](const LineSpan &span) { addSpan(out, span); });
+        for (size_t idx = 0; idx < movingCount; ++idx) finishLine(out, moving[idx]);
+        movingCount = 0;
+    }
+
+private:
+    // A line staying in one slot, possibly over several batches.
+    struct Hold {
+        int start;
+        int end;
+        int slot;
+    };
+
+    struct MovingLine {
+        uint64_t id;
+        ChatLine line;
+        Hold current;
+        std::optional<Hold> pending; // previous hold, waiting for the one it moves to
+        User spareUser;
+    };
+
+    void addSpan(BufferedWriter &out, const LineSpan &span) {
+        if (!params.assMoveScroll) {
+            beginEvent(out, span.start, span.end, *span.line);
+            out.write(posTags[span.slot]);
+            endEvent(out, *span.line);
+            return;
+        }
+        // Consecutive spans of one line in the same slot become a single hold.
+        Hold hold{span.start, span.end, span.slot};
+        auto begin = moving.begin(), end = moving.begin() + static_cast<std::ptrdiff_t>(movingCount);
+        auto it = std::lower_bound(begin, end, span.id, [](const MovingLine &line, uint64_t id) {
+            return line.id < id;
+        });
+        if (it == end || it->id != span.id) {
+            // New lines come in sequence order; the entry past the last one in use is reused.
+            size_t position = it - begin;
+            if (movingCount == moving.size()) moving.emplace_back();
+            MovingLine &line = moving[movingCount];
+            line.id = span.id;
+            copyLineInto(line.line, *span.line, line.spareUser);
+            line.current = hold;
+            line.pending.reset();
+            std::rotate(moving.begin() + static_cast<std::ptrdiff_t>(position),
+                        moving.begin() + static_cast<std::ptrdiff_t>(movingCount),
+                        moving.begin() + static_cast<std::ptrdiff_t>(movingCount + 1));
+            movingCount++;
+            return;
+        }
+        Hold &current = it->current;
+        if (current.slot == span.slot && current.end == span.start) {
+            current.end = span.end;
+            return;
+        }
+        completeHold(out, *it);
+        it->current = hold;
+    }
+
+    // A \move with t1 == t2 jumps to the next slot at that moment, so one event covers two holds.
+    void completeHold(BufferedWriter &out, MovingLine &line) {
+        if (!line.pending) {
+            line.pending = std::move(line.current);
+            return;
+        }
+        const Hold &from = *line.pending;
+        const Hold &to = line.current;
+        // Event times are written in centiseconds, measure the step from the rounded start.
+        int step = from.end / 10 * 10 - from.start / 10 * 10;
+        if (step <= 0) {
+            // The first hold ends in the centisecond it starts, so it is never shown. libass reads
+            // \move(...,0,0) as moving over the whole event, the second hold is written on its own.
+            beginEvent(out, to.start, to.end, line.line);
+            out.write(posTags[to.slot]);
+            endEvent(out, line.line);
+            line.pending.reset();
+            return;
+        }
+        beginEvent(out, from.start, to.end, line.line);
+        out.write("{\\move(");
+        out.fixed(posX, 3);
+        out.put(',');
+        out.fixed(posY[from.slot], 3);
+        out.put(',');
+        out.fixed(posX, 3);
+        out.put(',');
+        out.fixed(posY[to.slot], 3);
+        out.put(',');
+        out.integer(step);
+        out.put(',');
+        out.integer(step);
+        out.write(")}");
+        endEvent(out, line.line);
+        line.pending.reset();
+    }
+
+    // A hold left without a partner (lines that never change slot in the page layout) needs a
+    // single \pos event.
+    void finishLine(BufferedWriter &out, MovingLine &line) {
+        completeHold(out, line);
+        if (!line.pending) return;
+        beginEvent(out, line.pending->start, line.pending->end, line.line);
+        out.write(posTags[line.pending->slot]);
+        endEvent(out, line.line);
+    }
+
+    void beginEvent(BufferedWriter &out, int start, int end, const ChatLine &line) {
+        out.write("Dialogue: 0,");
+        writeAssTime(out, start);
+        out.put(',');
+        writeAssTime(out, end);
+        out.put(',');
+        out.write(line.user ? std::string_view(paletteEntry(userStyles, line.user->color)) : "Default");
+        out.write(",,0,0,0,,");
+        eventCount++;
+    }
+
+    // A username line starts in its user style, {\rDefault} switches to the message style.
+    static void endEvent(BufferedWriter &out, const ChatLine &line) {
+        if (line.user) {
+            writeAssEscaped(out, line.user->name);
+            out.write("{\\rDefault}");
+        }
+        writeAssEscaped(out, line.text);
+        out.put('\n');
+    }
+
+    LineSpanTracker spans;
+    int videoWidth;
+    int videoHeight;
+    double posX;
+    std::vector<double> posY;
+    std::vector<std::string> posTags;
+    std::map<Color, std::string> userStyles;
+    // assMoveScroll: lines still in the window, the first movingCount by sequence number. The
+    // entries after them are kept as spare storage.
+    std::vector<MovingLine> moving;
+    size_t movingCount = 0;
+};
+
+// Plain cue formats show the whole window as one multi-line cue per batch; the player decides
+// where it goes.
+class CueEmitter : public SubtitleEmitter {
+public:
+    explicit CueEmitter(const ChatParams &params) : SubtitleEmitter(params) {
+    }
+
+    std::string_view paletteName() const override {
+        return "colors";
+    }
+
+    void batch(BufferedWriter &out, const Batch &batch, int endTime) override {
+        if (batch.lines.empty()) return;
+        beginCue(out, batch.time, endTime);
+        for (const auto &line: batch.lines) {
+            // An empty line would end the cue.
+            if (!line.user && line.text.empty()) continue;
+            if (line.user) writeUser(out, *line.user);
+            writeText(out, line.text);
+            out.put('\n');
+        }
+        out.put('\n');
+        eventCount++;
+    }
+
+    void end(BufferedWriter &) override {
+    }
+
+protected:
+    // Gives every palette color an index and every username color the index of its palette color.
+    std::vector<Color> assignPalette(const std::vector<Color> &userColors) {
+        auto palette = quantizeColors(userColors, std::max(params.maxPens, 0));
+        std::map<Color, size_t> indices;
+        for (const auto &color: palette | std::views::values) indices[color] = 0;
+        std::vector<Color> colors;
+        for (auto &[color, index]: indices) {
+            index = colors.size();
+            colors.push_back(color);
+        }
+        for (const auto &color: userColors) userColorIndex[color] = indices[palette[color]];
+        paletteEntries = colors.size() + 1;
+        return colors;
+    }
+
+    virtual void beginCue(BufferedWriter &out, int start, int end) = 0;
+
+    virtual void writeUser(BufferedWriter &out, const User &user) = 0;
+
+    virtual void writeText(BufferedWriter &out, std::string_view text) = 0;
+
+    std::map<Color, size_t> userColorIndex;
+};
+
+// SubRip. Username colors use the <font> tag most players understand. SubRip has no escaping of
+// its own, but players that read the tags also decode the XML entities, so chat text that looks
+// like a tag is escaped like in WebVTT.
+class SrtEmitter : public CueEmitter {
+public:
+    using CueEmitter::CueEmitter;
+
+    void begin(BufferedWriter &, const std::vector<Color> &userColors) override {
+        for (const auto &color: assignPalette(userColors)) {
+            Color opaque = color;
+            opaque.a = Color::maxValue;
+            fontTags.push_back("<font color=\"" + opaque.toHexString() + "\">");
+        }
+    }
+
+protected:
+    void beginCue(BufferedWriter &out, int start, int end) override {
+        out.integer(static_cast<long long>(eventCount + 1));
+        out.put('\n');
+        writeClockTime(out, start, ',');
+        out.write(" --> ");
+        writeClockTime(out, end, ',');
+        out.put('\n');
+    }
+
+    void writeUser(BufferedWriter &out, const User &user) override {
+        out.write(fontTags[paletteEntry(userColorIndex, user.color)]);
+        writeXmlEscaped(out, user.name);
+        out.write("</font>");
+    }
+
+    void writeText(BufferedWriter &out, std::string_view text) override {
+        writeXmlEscaped(out, text);
+    }
+
+private:
+    std::vector<std::string> fontTags;
+};
+
+// WebVTT. Colors go into a STYLE block with one class per palette color; cues sit at the
+// configured margins and are aligned like the config's text.
+class WebVttEmitter : public CueEmitter {
+public:
+    explicit WebVttEmitter(const ChatParams &params) : CueEmitter(params) {
+        auto percent = [](int value) { return std::to_string(std::clamp(value, 0, 100)) + "%"; };
+        cueSettings = " position:" + percent(params.horizontalMargin) + " line:" + percent(params.verticalMargin) +
+                      " align:" + std::string(cueAlignment(params.textAlignment)) + "\n";
+    }
+
+    void begin(BufferedWriter &out, const std::vector<Color> &userColors) override {
+        out.write("WEBVTT\n\nSTYLE\n::cue {\n");
+        out.write("  color: ");
+        out.write(params.textForegroundColor.toHexString());
+        out.write(";\n  background-color: ");
+        out.write(params.textBackgroundColor.toHexString());
+        out.write(";\n}\n");
+        auto colors = assignPalette(userColors);
+        for (size_t i = 0; i < colors.size(); ++i) {
+            out.write("::cue(.u");
+            out.integer(static_cast<long long>(i));
+            out.write(") {\n  color: ");
+            out.write(colors[i].toHexString());
+            out.write(";\n}\n");
+            classTags.push_back("<c.u" + std::to_string(i) + ">");
+        }
+        out.put('\n');
+    }
+
+protected:
+    void beginCue(BufferedWriter &out, int start, int end) override {
+        writeClockTime(out, start, '.');
+        out.write(" --> ");
+        writeClockTime(out, end, '.');
+        out.write(cueSettings);
+    }
+
+    void writeUser(BufferedWriter &out, const User &user) override {
+        out.write(classTags[paletteEntry(userColorIndex, user.color)]);
+        writeXmlEscaped(out, user.name);
+        out.write("</c>");
+    }
+
+    void writeText(BufferedWriter &out, std::string_view text) override {
+        writeXmlEscaped(out, text);
+    }
+
+private:
+    static std::string_view cueAlignment(TextAlignment alignment) {
+        switch (alignment) {
+            case TextAlignment::Right: return "end";
+            case TextAlignment::Center: return "center";
+            default: return "start";
+        }
+    }
+
+    std::string cueSettings;
+    std::vector<std::string> classTags;
+};
+
+// Picks the format by the output file extension: .ass, .srt, .vtt, anything else is SRV3.
+inline std::unique_ptr<SubtitleEmitter> makeEmitter(const std::filesystem::path &output, const ChatParams &params,
+                                                    int videoWidth, int videoHeight) {
+    std::string extension = output.extension().string();
+    std::ranges::transform(extension, extension.begin(), ::tolower);
+    if (extension == ".ass") return std::make_unique<AssEmitter>(params, videoWidth, videoHeight);
+    if (extension == ".srt") return std::make_unique<SrtEmitter>(params);
+    if (extension == ".vtt") return std::make_unique<WebVttEmitter>(params);
+    return std::make_unique<Srv3Emitter>(params);
+}
+
+// Distinct username colors of all lines, sorted.
+inline std::vector<Color> collectUserColors(const std::vector<Batch> &batches) {
+    TraceScope trace("collectUserColors");
+    std::vector<Color> colors;
+    uint64_t seenLines = 0;
+    for (const auto &batch: batches) {
+        // Every line shows up in several batches, only look at the new ones.
+        for (uint64_t id = std::max(seenLines, batch.firstLine); id < batch.firstLine + batch.lines.size(); ++id) {
+            const auto &line = batch.lines[id - batch.firstLine];
+            if (line.user) colors.push_back(line.user->color);
+        }
+        seenLines = std::max(seenLines, batch.firstLine + batch.lines.size());
+    }
+    std::sort(colors.begin(), colors.end());
+    colors.erase(std::unique(colors.begin(), colors.end()), colors.end());
+    return colors;
+}
+
+// Feeds the batches through emitter into out.
+inline void writeSubtitles(SubtitleEmitter &emitter, BufferedWriter &out, const std::vector<Batch> &batches,
+                           SubtitleStats *stats = nullptr) {
+    TraceScope trace("writeSubtitles", static_cast<int64_t>(batches.size()));
+    auto userColors = collectUserColors(batches);
+    {
+        TraceScope traceBegin("emitter begin");
+        emitter.begin(out, userColors);
+    }
+    // Traced in runs of batches (args.n is the first one), which shows slow stretches such as the
+    // tail of the chat without an event per batch.
+    constexpr size_t traceRun = 1024;
+    for (size_t runStart = 0; runStart + 1 < batches.size(); runStart += traceRun) {
+        TraceScope traceBatches("emit batches", static_cast<int64_t>(runStart));
+        size_t runEnd = std::min(runStart + traceRun, batches.size() - 1);
+        for (size_t batchIndex = runStart; batchIndex < runEnd; ++batchIndex) {
+            emitter.batch(out, batches[batchIndex], batches[batchIndex + 1].time);
+        }
+    }
+    {
+        TraceScope traceEnd("emitter end");
+        emitter.end(out);
+    }
+    if (stats) {
+        stats->distinctColors = userColors.size();
+        stats->pens = emitter.paletteSize();
+        stats->events = emitter.events();
+        stats->bytes = out.size();
+    }
+}
+
+inline std::string generateXML(const std::vector<Batch> &batches, const ChatParams &params, SubtitleStats *stats = nullptr) {
+    Srv3Emitter emitter(params);
+    BufferedWriter out;
+    writeSubtitles(emitter, out, batches, stats);
+    return std::move(out.str());
+}
+
+inline std::string generateAss(const std::vector<Batch> &batches,
+                               const ChatParams &chat_params,
+                               int video_width, int video_height) {
+    AssEmitter emitter(chat_params, video_width, video_height);
+    BufferedWriter out;
+    writeSubtitles(emitter, out, batches);
+    return std::move(out.str());
+}
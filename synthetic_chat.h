@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ytt_generator.h"
+
+// Knobs of the synthetic chat. The same options and seed always give the same chat, on every
+// platform: the generator uses its own random numbers instead of the implementation-defined
+// std:: distributions.
+struct SyntheticChatOptions {
+    uint64_t seed = 1;
+    double rate = 10;          // average messages per second outside of bursts
+    size_t users = 5000;
+    double meanWords = 6;      // words per message, geometric distribution
+    size_t maxWords = 60;
+    double unicodeRatio = 0.1; // share of words taken from non-ASCII scripts, emoji and combining marks
+    double duplicateRatio = 0.05; // messages repeating one of the last few (copypasta, spam)
+    double burstEvery = 300;   // seconds between bursts, 0 for none
+    double burstLength = 20;   // seconds a burst lasts
+    double burstFactor = 10;   // rate multiplier during a burst
+};
+
+// Endless deterministic chat in time order.
+class SyntheticChat {
+public:
+    explicit SyntheticChat(const SyntheticChatOptions &options) : options(options), state(options.seed) {
+        users.reserve(options.users);
+        for (size_t i = 0; i < std::max<size_t>(options.users, 1); ++i) users.push_back(makeUser(i));
+    }
+
+    ChatMessage next() {
+        advanceTime();
+        ChatMessage message;
+        message.time = static_cast<uint64_t>(seconds * 1000);
+        // Few users write most of the chat.
+        double pick = uniform();
+        message.user = users[static_cast<size_t>(pick * pick * static_cast<double>(users.size()))];
+
+        if (!recent.empty() && uniform() < options.duplicateRatio) {
+            message.message = recent[static_cast<size_t>(uniform() * static_cast<double>(recent.size()))];
+            return message;
+        }
+        size_t words = 1;
+        double stop = 1 / std::max(options.meanWords, 1.0);
+        while (words < options.maxWords && uniform() >= stop) words++;
+        for (size_t i = 0; i < words; ++i) {
+            if (i) message.message.push_back(' ');
+            message.message.append(word());
+        }
+        recent.push_back(message.message);
+        if (recent.size() > 32) recent.pop_front();
+        return message;
+    }
+
+    std::vector<ChatMessage> take(size_t count) {
+        std::vector<ChatMessage> messages;
+        messages.reserve(count);
+        for (size_t i = 0; i < count; ++i) messages.push_back(next());
+        return messages;
+    }
+
+private:
+    // splitmix64
+    uint64_t random() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // In [0, 1).
+    double uniform() {
+        return static_cast<double>(random() >> 11) * 0x1.0p-53;
+    }
+
+    size_t below(size_t n) {
+        return static_cast<size_t>(random() % n);
+    }
+
+    Color::cType channel() {
+        return static_cast<Color::cType>(below(Color::maxValue + 1));
+    }
+
+    // Poisson arrivals at the current rate.
+    void advanceTime() {
+        bool bursting = options.burstEvery > 0 &&
+                        std::fmod(seconds, options.burstEvery) >= options.burstEvery - options.burstLength;
+        double rate = std::max(options.rate * (bursting ? options.burstFactor : 1), 1e-6);
+        seconds += -std::log(1 - uniform()) / rate;
+    }
+
+    User makeUser(size_t index) {
+        static constexpr std::string_view syllables[] = {
+            "ka", "mi", "to", "ra", "zu", "no", "shi", "ex", "pro", "gg", "xx", "lol", "dark", "neo", "_", "2"
+        };
+        User user;
+        size_t parts = 1 + below(4);
+        for (size_t i = 0; i < parts; ++i) user.name.append(syllables[below(std::size(syllables))]);
+        user.name.append(std::to_string(index));
+        // Some users never picked a color, the CSV leaves it empty then.
+        if (uniform() < 0.2) {
+            user.color = getRandomColor(user.name);
+        } else {
+            const auto &palette = defaultUserColors();
+            user.color = uniform() < 0.7 ? palette[below(palette.size())]
+                                         : Color(channel(), channel(), channel());
+        }
+        return user;
+    }
+
+    std::string_view word() {
+        static constexpr std::string_view ascii[] = {
+            "lorem", "ipsum", "dolor", "sit", "amet", "the", "a", "is", "this", "what", "no", "yes", "gg", "wp",
+            "lmao", "bro", "chat", "streamer", "game", "LUL", "Kappa", "PogChamp", "KEKW", "monkaS", "OMEGALUL",
+            "!drop", "@mod", "https://example.com/clip", "consectetur", "adipiscing", "eiusmod", "tempor", "10/10"
+        };
+        static constexpr std::string_view unicode[] = {
+            "привет", "спасибо", "чат", "你好", "谢谢", "こんにちは", "草", "안녕", "😂", "❤️", "🔥🔥🔥", "👀",
+            "été", "ño", "Zalgo̶̷̸", "مرحبا", "שלום", "ñandú", "Größe"
+        };
+        if (uniform() < options.unicodeRatio) return unicode[below(std::size(unicode))];
+        return ascii[below(std::size(ascii))];
+    }
+
+    SyntheticChatOptions options;
+    uint64_t state;
+    double seconds = 0;
+    std::vector<User> users;
+    std::deque<std::string> recent;
+};
+
+// In the format parseCSV reads, the username color left empty when it is the generated one.
+inline void writeChatCsv(std::ostream &out, const std::vector<ChatMessage> &messages) {
+    out << csvHeader << '\n';
+    std::string line;
+    for (const auto &message: messages) {
+        line = std::to_string(message.time);
+        line.push_back(',');
+        line.append(message.user.name);
+        line.push_back(',');
+        if (message.user.color != getRandomColor(message.user.name)) line.append(message.user.color.toHexString());
+        line.push_back(',');
+        line.append(message.message);
+        line.push_back('\n');
+        out << line;
+    }
+}
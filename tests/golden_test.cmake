@@ -0,0 +1,37 @@
+# Runs subtitles_generator and compares what it wrote with golden files, for add_test() in the
+# top-level CMakeLists.txt:
+#
+#   cmake -DGENERATOR=<exe> -DARGS=<args separated by |> -DOUTPUTS=<files separated by |>
+#         -DGOLDENS=<files separated by |> -P golden_test.cmake
+#
+# To accept a changed output, copy the file named in the failure over its golden file.
+
+string(REPLACE "|" ";" ARGS "${ARGS}")
+string(REPLACE "|" ";" OUTPUTS "${OUTPUTS}")
+string(REPLACE "|" ";" GOLDENS "${GOLDENS}")
+
+foreach (output IN LISTS OUTPUTS)
+    file(REMOVE "${output}")
+endforeach ()
+
+execute_process(COMMAND "${GENERATOR}" ${ARGS} RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "subtitles_generator failed (${result})")
+endif ()
+
+set(failures 0)
+list(LENGTH OUTPUTS count)
+math(EXPR last "${count} - 1")
+foreach (i RANGE ${last})
+    list(GET OUTPUTS ${i} output)
+    list(GET GOLDENS ${i} golden)
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files --ignore-eol "${output}" "${golden}"
+            RESULT_VARIABLE different)
+    if (different)
+        message(SEND_ERROR "${output} differs from ${golden}")
+        math(EXPR failures "${failures} + 1")
+    endif ()
+endforeach ()
+if (failures)
+    message(FATAL_ERROR "${failures} output(s) differ from their golden files")
+endif ()
@@ -0,0 +1,114 @@
+// IrcConnection against a stand-in chat server on 127.0.0.1. The connection has to ask for tags
+// and join the channel, answer the server's PING itself, put a line split over two packets back
+// together and hand out the remaining lines, which IrcLineParser turns into messages.
+// Prints every failed check and exits with 1 if there was one.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "irc_input.h"
+
+static int failures = 0;
+
+static void check(bool condition, std::string_view what) {
+    if (condition) return;
+    std::cerr << "FAIL: " << what << "\n";
+    failures++;
+}
+
+static void sendAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t count = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (count <= 0) return;
+        data.remove_prefix(static_cast<size_t>(count));
+    }
+}
+
+// Appends what the client sends to received until it contains text; false when the client closed
+// the connection or stayed silent for 5 s.
+static bool receiveUntil(int fd, std::string &received, std::string_view text) {
+    char chunk[4096];
+    while (received.find(text) == std::string::npos) {
+        ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+        if (count <= 0) return false;
+        received.append(chunk, static_cast<size_t>(count));
+    }
+    return true;
+}
+
+int main() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressSize = sizeof(address);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), addressSize) != 0 ||
+        listen(listener, 1) != 0 || getsockname(listener, reinterpret_cast<sockaddr *>(&address), &addressSize) != 0) {
+        std::cerr << "Cannot listen on 127.0.0.1\n";
+        return 1;
+    }
+
+    std::string received;
+    bool registered = false, ponged = false;
+    std::thread server([&] {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) return;
+        timeval timeout{5, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        registered = receiveUntil(client, received, "JOIN #tsoding\r\n");
+        sendAll(client, ":tmi.twitch.tv 001 justinfan12345 :Welcome, GLHF!\r\n"
+                        "PING :tmi.twitch.tv\r\n"
+                        "@color=#FF4500;display-name=Alice;tmi-sent-ts=1700000000000 "
+                        ":alice!alice@alice.tmi.twitch.tv PRIVMSG #tsoding :hello\r\n"
+                        "@color=#1E90FF;display-name=Bob;tmi-sent-ts=1700000001500 "
+                        ":bob!bob@bob.tmi.twitch.tv PRIVMSG #tso");
+        ponged = receiveUntil(client, received, "PONG :tmi.twitch.tv\r\n");
+        sendAll(client, "ding :split over two packets\r\n");
+        ::close(client);
+    });
+
+    std::vector<std::string> lines;
+    try {
+        IrcConnection connection("127.0.0.1", std::to_string(ntohs(address.sin_port)), "tsoding");
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!connection.closed() && std::chrono::steady_clock::now() < deadline) {
+            connection.wait(std::chrono::milliseconds(100));
+            connection.read([&](std::string_view line) { lines.emplace_back(line); });
+        }
+        check(connection.closed(), "the connection sees the server close it");
+    } catch (const std::exception &e) {
+        check(false, e.what());
+    }
+    server.join();
+    ::close(listener);
+
+    check(registered, "the client joins #tsoding");
+    check(received.starts_with("CAP REQ :twitch.tv/tags\r\nNICK justinfan"), "the client asks for tags first");
+    check(ponged, "the client answers PING with PONG");
+    check(lines.size() == 3, "the lines other than PING are handed out");
+    for (const auto &line: lines) check(!line.starts_with("PING"), "PING is not handed out");
+
+    IrcLineParser parser;
+    std::vector<ChatMessage> messages;
+    for (const auto &line: lines) {
+        ChatMessage message;
+        if (parser.parse(line, message)) messages.push_back(std::move(message));
+    }
+    check(messages.size() == 2, "two chat messages arrive");
+    if (messages.size() == 2) {
+        check(messages[0].user.name == "Alice" && messages[0].message == "hello" && messages[0].time == 0,
+              "the first message is Alice's at 0");
+        check(messages[0].user.color == Color(std::string("#FF4500")), "the color tag is the username color");
+        check(messages[1].user.name == "Bob" && messages[1].message == "split over two packets" &&
+              messages[1].time == 1500, "the split line arrives whole, 1.5 s later");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+// The overlay's event stream of a followed chat. Starts
+//   <generator> --follow --serve 0 -c <config> -i <dir>/overlay_events.csv -u ms
+// on a chat that only has its header, subscribes to /events on 127.0.0.1, appends messages and
+// checks the batch events they give. The config has two lines in the window.
+// Prints every failed check and exits with 1 if there was one.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+extern char **environ;
+
+static int failures = 0;
+
+static void check(bool condition, std::string_view what) {
+    if (condition) return;
+    std::cerr << "FAIL: " << what << "\n";
+    failures++;
+}
+
+static void append(const std::filesystem::path &path, std::string_view lines) {
+    std::ofstream(path, std::ios::binary | std::ios::app) << lines;
+}
+
+// Reads from fd until buffer holds text, for at most 10 s. Returns false on timeout or end of data.
+static bool readUntil(int fd, std::string &buffer, std::string_view text) {
+    char chunk[4096];
+    while (buffer.find(text) == std::string::npos) {
+        pollfd ready{fd, POLLIN, 0};
+        if (poll(&ready, 1, 10000) <= 0) return false;
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count <= 0) return false;
+        buffer.append(chunk, static_cast<size_t>(count));
+    }
+    return true;
+}
+
+// The data of the next "batch" event of the stream; empty when none arrived in time.
+static std::string nextBatch(int fd, std::string &stream) {
+    while (readUntil(fd, stream, "\n\n")) {
+        size_t end = stream.find("\n\n");
+        std::string event = stream.substr(0, end);
+        stream.erase(0, end + 2);
+        if (event.starts_with("event: batch\ndata: ")) return event.substr(event.find('\n') + 7);
+    }
+    return {};
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        std::cerr << "Usage: overlay_events_test <subtitles_generator> <config> <work directory>\n";
+        return 1;
+    }
+    std::filesystem::path chat = std::filesystem::path(argv[3]) / "overlay_events.csv";
+    std::ofstream(chat, std::ios::binary | std::ios::trunc) << "time,user_name,user_color,message\n";
+
+    int output[2];
+    if (pipe(output) != 0) return 1;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, output[0]);
+    std::string chatPath = chat.string();
+    // The idle timeout ends the generator should this test die before stopping it.
+    char *args[] = {
+        argv[1], const_cast<char *>("--follow"), const_cast<char *>("--serve"), const_cast<char *>("0"),
+        const_cast<char *>("--idle-timeout"), const_cast<char *>("30"), const_cast<char *>("-c"), argv[2],
+        const_cast<char *>("-i"), chatPath.data(), const_cast<char *>("-u"), const_cast<char *>("ms"), nullptr
+    };
+    pid_t generator;
+    if (posix_spawn(&generator, argv[1], &actions, nullptr, args, environ) != 0) {
+        std::cerr << "Cannot start " << argv[1] << "\n";
+        return 1;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(output[1]);
+
+    std::string printed;
+    constexpr std::string_view announcement = "Overlay: http://127.0.0.1:";
+    int events = -1;
+    if (readUntil(output[0], printed, "/\n")) {
+        size_t at = printed.find(announcement);
+        int port = at == std::string::npos ? 0 : std::stoi(printed.substr(at + announcement.size()));
+        events = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (connect(events, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            close(events);
+            events = -1;
+        }
+    }
+    check(events >= 0, "the generator announces the overlay port and accepts connections");
+
+    if (events >= 0) {
+        std::string_view request = "GET /events HTTP/1.1\r\nHost: 127.0.0.1\r\nAccept: text/event-stream\r\n\r\n";
+        check(write(events, request.data(), request.size()) == static_cast<ssize_t>(request.size()), "the request is sent");
+        std::string stream;
+        check(readUntil(events, stream, "\r\n\r\n") && stream.starts_with("HTTP/1.1 200 OK\r\n") &&
+              stream.find("Content-Type: text/event-stream\r\n") != std::string::npos, "/events is an event stream");
+        stream.erase(0, stream.find("\r\n\r\n") + 4);
+
+        // Subscribed, so the first message's batch is pushed to this client.
+        append(chat, "1000,alice,#FF0000,hello\n");
+        std::string first = nextBatch(events, stream);
+        check(first == R"({"time":1000,"first":0,"from":0,"lines":[{"user":"alice","color":"#FE0000","text":":hello"}]})",
+              "the first batch lists the only line: " + first);
+
+        // The third line scrolls the first out of the window, the event lists only the new line.
+        append(chat, "2000,bob,#0000FF,hi\n3000,carol,#00FF00,\"a, b\"\n");
+        std::string second = nextBatch(events, stream);
+        check(second.starts_with(R"({"time":2000,"first":0,"from":1,"lines":[{"user":"bob")"),
+              "the second batch adds the second line: " + second);
+        std::string third = nextBatch(events, stream);
+        check(third == R"({"time":3000,"first":1,"from":2,"lines":[{"user":"carol","color":"#00FE00","text":":a, b"}]})",
+              "the third batch starts at the second line and adds the third: " + third);
+        close(events);
+    }
+
+    kill(generator, SIGTERM);
+    int status = 0;
+    waitpid(generator, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "the generator stops cleanly on SIGTERM");
+    close(output[0]);
+    std::filesystem::remove(chat);
+    return failures ? 1 : 0;
+}
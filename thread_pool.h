@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+// Fixed set of worker threads taking tasks from one shared queue.
+// Tasks report their own errors, an exception escaping a task terminates the program.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; ++i) workers.emplace_back([this] { work(); });
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Finishes the queued tasks first.
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        taskAdded.notify_all();
+        for (auto &worker: workers) worker.join();
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard lock(mutex);
+            tasks.push_back(std::move(task));
+            unfinished++;
+        }
+        taskAdded.notify_one();
+    }
+
+    // Blocks until every submitted task has finished.
+    void wait() {
+        std::unique_lock lock(mutex);
+        allDone.wait(lock, [this] { return unfinished == 0; });
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+private:
+    void work() {
+        Tracer::instance().nameThread("pool worker");
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex);
+                taskAdded.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+            std::lock_guard lock(mutex);
+            if (--unfinished == 0) allDone.notify_all();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable taskAdded;
+    std::condition_variable allDone;
+    std::deque<std::function<void()> > tasks;
+    size_t unfinished = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+// Bytes that running jobs may hold together. acquire() blocks until the request fits; a request
+// larger than the whole budget waits for everything else to finish and then runs alone.
+// A limit of 0 means no limit.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(uint64_t limit) : limit(limit) {
+    }
+
+    // Returns the amount actually taken, which has to be handed back to release().
+    uint64_t acquire(uint64_t bytes) {
+        if (limit == 0) return 0;
+        TraceScope trace("memory budget wait");
+        bytes = std::min(bytes, limit);
+        std::unique_lock lock(mutex);
+        released.wait(lock, [&] { return used + bytes <= limit; });
+        used += bytes;
+        return bytes;
+    }
+
+    void release(uint64_t bytes) {
+        if (bytes == 0) return;
+        {
+            std::lock_guard lock(mutex);
+            used -= bytes;
+        }
+        released.notify_all();
+    }
+
+private:
+    uint64_t limit;
+    uint64_t used = 0;
+    std::mutex mutex;
+    std::condition_variable released;
+};
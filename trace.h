@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Timeline of the pipeline for --trace, written as Chrome trace event JSON (chrome://tracing,
+// ui.perfetto.dev). Every thread records into its own buffer without locking; the buffers are
+// only read by write(), after the traced threads are done. While tracing is off a TraceScope
+// costs one relaxed atomic load.
+class Tracer {
+public:
+    static Tracer &instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void start() {
+        origin = std::chrono::steady_clock::now();
+        on.store(true, std::memory_order_relaxed);
+    }
+
+    bool enabled() const {
+        return on.load(std::memory_order_relaxed);
+    }
+
+    // Names the calling thread in the trace.
+    void nameThread(std::string name) {
+        if (enabled()) local().name = std::move(name);
+    }
+
+    // name has to outlive the tracer (a string literal); arg is shown as args.n when not negative.
+    void record(const char *name, std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end, int64_t arg) {
+        local().events.push_back({name, start, end, arg});
+    }
+
+    // Call once every traced thread has finished.
+    void write(std::ostream &out) {
+        on.store(false, std::memory_order_relaxed);
+        std::lock_guard lock(registryMutex);
+        auto micros = [&](std::chrono::steady_clock::time_point t) {
+            return std::chrono::duration<double, std::micro>(t - origin).count();
+        };
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        for (const auto &buffer: buffers) {
+            if (!buffer->name.empty()) {
+                out << (first ? "" : ",\n") << std::format(
+                    R"({{"ph":"M","name":"thread_name","pid":1,"tid":{},"args":{{"name":"{}"}}}})",
+                    buffer->tid, buffer->name);
+                first = false;
+            }
+            for (const auto &event: buffer->events) {
+                out << (first ? "" : ",\n") << std::format(
+                    R"({{"ph":"X","name":"{}","cat":"subchat","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f})",
+                    event.name, buffer->tid, micros(event.start), micros(event.end) - micros(event.start));
+                if (event.arg >= 0) out << std::format(R"(,"args":{{"n":{}}})", event.arg);
+                out << "}";
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    struct Event {
+        const char *name;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point end;
+        int64_t arg;
+    };
+
+    struct Buffer {
+        uint32_t tid;
+        std::string name;
+        std::vector<Event> events;
+    };
+
+    // The calling thread's buffer, registered on first use. Buffers stay with the tracer, so
+    // events of threads that already ended are still written.
+    Buffer &local() {
+        thread_local Buffer *buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard lock(registryMutex);
+            buffers.push_back(std::make_unique<Buffer>());
+            buffer = buffers.back().get();
+            buffer->tid = static_cast<uint32_t>(buffers.size());
+            buffer->events.reserve(1024);
+        }
+        return *buffer;
+    }
+
+    std::atomic<bool> on = false;
+    std::chrono::steady_clock::time_point origin;
+    std::mutex registryMutex;
+    std::vector<std::unique_ptr<Buffer> > buffers;
+};
+
+// Records the time from construction to destruction as one trace event.
+class TraceScope {
+public:
+    explicit TraceScope(const char *name, int64_t arg = -1)
+        : name(Tracer::instance().enabled() ? name : nullptr), arg(arg) {
+        if (this->name) start = std::chrono::steady_clock::now();
+    }
+
+    TraceScope(const TraceScope &) = delete;
+
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    ~TraceScope() {
+        if (name) Tracer::instance().record(name, start, std::chrono::steady_clock::now(), arg);
+    }
+
+private:
+    const char *name;
+    int64_t arg;
+    std::chrono::steady_clock::time_point start;
+};
@@ -14,42 +14,40 @@
 #include <iterator>
 #include <queue>
 #include <ranges>
+#include <cmath>
+#include <stdexcept>
 
 #if defined(_WIN32)
 #undef assert
 #endif
 
 #include "utf8.h"
-#include "tinyxml2.h"
 #include "SimpleIni.h"
 #include "magic_enum.hpp"
-#include <format>
+#include "trace.h"
 
 // Returns the number of UTF‑8 code points in s.
-inline int utf8_length(const std::string &s) {
+inline int utf8_length(std::string_view s) {
     return static_cast<int>(utf8::distance(s.begin(), s.end()));
 }
 
-// Returns the first 'count' UTF‑8 code points of s.
-inline std::string utf8_substr(const std::string &s, int count) {
+// Returns the size in bytes of the first 'count' UTF‑8 code points of s.
+inline size_t utf8_prefix_size(std::string_view s, int count) {
     auto it = s.begin();
-    int i = 0;
-    while (it != s.end() && i < count) {
+    for (int i = 0; it != s.end() && i < count; ++i) {
         utf8::next(it, s.end());
-        ++i;
     }
-    return {s.begin(), it};
+    return static_cast<size_t>(it - s.begin());
+}
+
+// Returns the first 'count' UTF‑8 code points of s.
+inline std::string utf8_substr(const std::string &s, int count) {
+    return s.substr(0, utf8_prefix_size(s, count));
 }
 
 // Returns the remainder of s after consuming the first 'count' UTF‑8 code points.
 inline std::string utf8_consume(const std::string &s, int count) {
-    auto it = s.begin();
-    int i = 0;
-    while (it != s.end() && i < count) {
-        utf8::next(it, s.end());
-        ++i;
-    }
-    return {it, s.end()};
+    return s.substr(utf8_prefix_size(s, count));
 }
 
 template<typename T, T Max>
@@ -222,6 +220,11 @@ enum class TextAlignment {
     Left, Right, Center
 };
 
+enum class ChatLayout {
+    Scroll, // every new line pushes the window up by one slot
+    Page // lines keep their slot until the window is full, then it is cleared
+};
+
 
 template<typename E>
 std::string enumToString(E e) {
@@ -281,10 +284,17 @@ struct ChatParams {
     int verticalMargin = 0;
     int verticalSpacing = -1;
     int totalDisplayLines = 13;
+    ChatLayout layout = ChatLayout::Scroll;
 
     int maxCharsPerLine = 25;
     std::string usernameSeparator = ":";
 
+    int maxPens = 0;
+    bool compactOutput = false;
+    bool assMoveScroll = false;
+
+    bool operator==(const ChatParams &) const = default;
+
     void saveToFile(const char *filename) const {
         CSimpleIniCaseA ini;
         ini.SetUnicode();
@@ -337,13 +347,24 @@ struct ChatParams {
         ini.SetLongValue(S, "verticalSpacing", verticalSpacing,
                          ";virtual pixels");
         ini.SetLongValue(S, "totalDisplayLines", totalDisplayLines,
-                         ";lines");
+                         ";lines"); {
+            const auto val = enumToString(layout);
+            const auto cm = enumOptionsComment<ChatLayout>() + " (Page needs verticalSpacing != -1)";
+            ini.SetValue(S, "layout", val.c_str(), cm.c_str());
+        }
 
         ini.SetLongValue(S, "maxCharsPerLine", maxCharsPerLine,
                          ";characters");
         ini.SetValue(S, "usernameSeparator", usernameSeparator.c_str(),
                      ";string between name and message");
 
+        ini.SetLongValue(S, "maxPens", maxPens,
+                         ";username color pens, 0 = one pen per distinct color");
+        ini.SetBoolValue(S, "compactOutput", compactOutput,
+                         ";true/false, drop indentation and redundant markup from SRV3 output");
+        ini.SetBoolValue(S, "assMoveScroll", assMoveScroll,
+                         ";true/false, ASS: cover each line with a few \\move events instead of one event per batch");
+
         ini.SaveFile(filename);
     }
 
@@ -393,6 +414,12 @@ struct ChatParams {
                              enumToString(textAlignment).c_str()));
         } catch (...) {
         }
+        try {
+            layout = enumFromString<ChatLayout>(
+                ini.GetValue(S, "layout",
+                             enumToString(layout).c_str()));
+        } catch (...) {
+        }
         fontSizePercent = static_cast<int>(
             ini.GetLongValue(S, "fontSizePercent",
                              fontSizePercent));
@@ -415,6 +442,11 @@ struct ChatParams {
         usernameSeparator = ini.GetValue(S, "usernameSeparator",
                                          usernameSeparator.c_str());
 
+        maxPens = static_cast<int>(
+            ini.GetLongValue(S, "maxPens",
+                             maxPens));
+        compactOutput = ini.GetBoolValue(S, "compactOutput", compactOutput);
+        assMoveScroll = ini.GetBoolValue(S, "assMoveScroll", assMoveScroll);
 
         return true;
     }
@@ -443,12 +475,15 @@ struct ChatLine {
 struct Batch {
     int time;
     std::deque<ChatLine> lines;
+    uint64_t firstLine = 0; // sequence number of lines.front() among all wrapped lines
 };
 
 inline std::pair<std::string, std::vector<std::string> > wrapMessage(std::string username,
                                                                      std::string separator,
                                                                      const std::string &message,
                                                                      int maxWidth) {
+    // Long words are cut into pieces of at least one code point, which needs room for one.
+    maxWidth = std::max(maxWidth, 1);
     std::vector<std::string> lines;
     int availableSpace = maxWidth;
     if (utf8_length(username) > maxWidth) {
@@ -465,411 +500,399 @@ inline std::pair<std::string, std::vector<std::string> > wrapMessage(std::string
     availableSpace -= utf8_length(separator);
 
 
-    std::istringstream iss(message);
-    std::vector<std::string> words;
-    std::string word;
+    // Words are what `istream >> word` would read: runs of non-whitespace. They are views into
+    // message, so only the lines allocate.
+    auto isSpace = [](char c) { return c == ' ' || (c >= '\t' && c <= '\r'); };
     bool firstWord = true;
-    while (iss >> word) {
+    for (size_t pos = 0;;) {
+        while (pos < message.size() && isSpace(message[pos])) pos++;
+        if (pos == message.size()) break;
+        size_t end = pos;
+        while (end < message.size() && !isSpace(message[end])) end++;
+        std::string_view word(message.data() + pos, end - pos);
+        pos = end;
+
+        // Words longer than a line are cut where the space runs out. The cut off part is dropped
+        // from the view and its length subtracted, so a long word takes linear time.
+        int wordLength = utf8_length(word);
         bool bigWord = false;
-        while (utf8_length(word) > maxWidth) {
+        while (wordLength > maxWidth) {
             bigWord = true;
             if (availableSpace < 2) {
                 availableSpace = maxWidth;
-                lines.push_back(utf8_substr(word, availableSpace));
-                firstWord = false;
-            } else {
-                if (!firstWord) {
-                    lines.back() += " ";
-                    availableSpace--;
-                }
-                lines.back() += utf8_substr(word, availableSpace);
-                firstWord = false;
+                lines.emplace_back();
+            } else if (!firstWord) {
+                lines.back() += " ";
+                availableSpace--;
             }
-            word = utf8_consume(word, availableSpace); // add split
+            firstWord = false;
+            size_t cut = utf8_prefix_size(word, availableSpace); // add split
+            lines.back() += word.substr(0, cut);
+            word.remove_prefix(cut);
+            wordLength -= availableSpace;
             availableSpace = 0;
         }
         if (bigWord) {
             //if (utf8_length(word) < availableSpace) word += " ";
-            lines.push_back(word);
-            availableSpace = maxWidth - utf8_length(word);
+            lines.emplace_back(word);
+            availableSpace = maxWidth - wordLength;
             firstWord = false;
             continue;
         }
-        if (utf8_length(word) < availableSpace) {
+        if (wordLength < availableSpace) {
             if (!firstWord) {
                 lines.back() += " ";
                 availableSpace--;
             }
             lines.back() += word;
-            availableSpace -= utf8_length(word);
+            availableSpace -= wordLength;
         } else {
             //if (utf8_length(word) < maxWidth) word += " ";
-            lines.push_back(word);
-            availableSpace = maxWidth - utf8_length(word);
+            lines.emplace_back(word);
+            availableSpace = maxWidth - wordLength;
         }
         firstWord = false;
     }
     //    for (const auto& line :lines){
     //        assert(utf8_length(line)<=maxWidth);
     //    }
-    return {username, lines};
+    return {std::move(username), std::move(lines)};
 }
 
-inline std::vector<Batch> generateBatches(const std::vector<ChatMessage> &messages, const ChatParams &params) {
-    std::vector<Batch> batches;
-    std::deque<ChatLine> currentLines;
+// A message split into display lines; the first one carries the username.
+struct WrappedMessage {
+    uint64_t time;
+    std::vector<ChatLine> lines;
+};
+
+inline WrappedMessage wrapChatMessage(const ChatMessage &msg, const ChatParams &params) {
+    auto [username, wrapped] = wrapMessage(msg.user.name, params.usernameSeparator, msg.message,
+                                           params.maxCharsPerLine);
+    WrappedMessage message{msg.time, {}};
+    if (wrapped.empty())
+        return message;
+
+    message.lines.reserve(wrapped.size());
+    message.lines.emplace_back(std::make_optional<User>(std::move(username), msg.user.color), std::move(wrapped[0]));
+    for (size_t i = 1; i < wrapped.size(); ++i) {
+        message.lines.emplace_back(std::nullopt, std::move(wrapped[i]));
+    }
+    return message;
+}
+
+// Wrapping only depends on maxCharsPerLine and usernameSeparator, so the result can be shared by
+// configs that differ in anything else.
+inline std::vector<WrappedMessage> wrapMessages(const std::vector<ChatMessage> &messages, const ChatParams &params) {
+    TraceScope trace("wrapMessages", static_cast<int64_t>(messages.size()));
+    std::vector<WrappedMessage> result;
+    result.reserve(messages.size());
     for (const auto &msg: messages) {
-        auto [username, wrapped] = wrapMessage(msg.user.name, params.usernameSeparator, msg.message,
-                                               params.maxCharsPerLine);
-        if (wrapped.empty())
+        WrappedMessage message = wrapChatMessage(msg, params);
+        if (message.lines.empty())
             continue;
+        result.push_back(std::move(message));
+    }
+    return result;
+}
+
+// The sliding chat window, fed one wrapped message at a time.
+// The first message of every new timestamp starts a batch holding the window right after it;
+// messages with the same timestamp only show up from the next batch on.
+class ChatBatcher {
+public:
+    explicit ChatBatcher(int totalDisplayLines) : totalDisplayLines(std::max(totalDisplayLines, 0)) {
+    }
 
-        currentLines.emplace_back(std::make_optional<User>(username, msg.user.color), wrapped[0]);
-        if (currentLines.size() > params.totalDisplayLines) currentLines.pop_front();
-        for (size_t i = 1; i < wrapped.size(); ++i) {
-            currentLines.emplace_back(std::nullopt, wrapped[i]);
-            if (currentLines.size() > params.totalDisplayLines) currentLines.pop_front();
+    // Returns the batch this message starts, or nullptr. The batch stays valid until the next push().
+    const Batch *push(const WrappedMessage &msg) {
+        for (const auto &line: msg.lines) {
+            currentLines.push_back(line);
+            if (currentLines.size() > totalDisplayLines) currentLines.pop_front();
         }
-        if (!batches.empty() && batches.back().time == msg.time)
-            continue;
-        batches.emplace_back(msg.time, currentLines);
+        lineCount += msg.lines.size();
+        if (started && batch.time == static_cast<int>(msg.time))
+            return nullptr;
+        started = true;
+        batch = {static_cast<int>(msg.time), currentLines, lineCount - currentLines.size()};
+        return &batch;
+    }
+
+private:
+    size_t totalDisplayLines;
+    std::deque<ChatLine> currentLines;
+    uint64_t lineCount = 0;
+    bool started = false;
+    Batch batch{};
+};
+
+inline std::vector<Batch> generateBatches(const std::vector<WrappedMessage> &messages, int totalDisplayLines) {
+    TraceScope trace("generateBatches", static_cast<int64_t>(messages.size()));
+    std::vector<Batch> batches;
+    ChatBatcher batcher(totalDisplayLines);
+    for (const auto &msg: messages) {
+        if (const Batch *batch = batcher.push(msg)) batches.push_back(*batch);
     }
     return batches;
 }
 
-inline std::string generateXML(const std::vector<Batch> &batches, const ChatParams &params) {
-    using namespace tinyxml2;
-    XMLDocument doc;
+inline std::vector<Batch> generateBatches(const std::vector<ChatMessage> &messages, const ChatParams &params) {
+    return generateBatches(wrapMessages(messages, params), params.totalDisplayLines);
+}
 
-    std::map<Color, std::string> colors;
-    colors[params.textForegroundColor] = "";
-    // Not optimal, but I want to factor out messages
-    for (const auto &m: batches) {
-        for (const auto &l: m.lines) {
-            if (l.user.has_value())colors[l.user->color] = "";
+// The batches of the time range [from, to) (ms), timed from its start. The last batch before the
+// range moves to its start, so the window starts out filled; the first one at or after `to` moves
+// to `to` and only ends the batch before it.
+inline std::vector<Batch> clipBatches(const std::vector<Batch> &batches, int from, int to) {
+    std::vector<Batch> result;
+    for (const auto &batch: batches) {
+        if (batch.time >= to) {
+            result.push_back(batch);
+            result.back().time = to;
+            break;
+        }
+        if (!result.empty() && result.back().time == from && batch.time <= from) {
+            result.back() = batch;
+        } else {
+            result.push_back(batch);
         }
+        result.back().time = std::max(result.back().time, from);
     }
+    for (auto &batch: result) batch.time -= from;
+    return result;
+}
 
-    XMLElement *root = doc.NewElement("timedtext");
-    root->SetAttribute("format", "3");
-    doc.InsertFirstChild(root);
-
-    XMLElement *head = doc.NewElement("head");
-    root->InsertEndChild(head);
-    XMLElement *body = doc.NewElement("body");
-    root->InsertEndChild(body);
-
-    // Create pen elements for each unique color.
-    int penIndex = 0;
-    for (auto &kv: colors) {
-        const Color &color = kv.first;
-        XMLElement *pen = doc.NewElement("pen");
-        pen->SetAttribute("id", std::to_string(penIndex).c_str());
-        pen->SetAttribute("b", (params.textBold ? "1" : "0"));
-        pen->SetAttribute("i", (params.textItalic ? "1" : "0"));
-        pen->SetAttribute("u", (params.textUnderline ? "1" : "0"));
-
-        // Use the friendly textForegroundColor if it differs from default white.
-        pen->SetAttribute("fc", static_cast<std::string>(color).c_str());
-        pen->SetAttribute("fo", std::to_string(params.textForegroundColor.a).c_str());
-        pen->SetAttribute("bc", static_cast<std::string>(params.textBackgroundColor).c_str());
-        pen->SetAttribute("bo", std::to_string(params.textBackgroundColor.a).c_str());
-
-        // Set edge attributes if provided.
-        std::string textEdgeType = enumToIntString(params.textEdgeType);
-        if (!textEdgeType.empty()) {
-            pen->SetAttribute("ec", static_cast<std::string>(params.textEdgeColor).c_str());
-            pen->SetAttribute("et", textEdgeType.c_str());
+// Frame coalescing: a batch starting less than interval ms after the first batch of its group
+// joins the group, which shows the window of its last batch from the time of its first. Messages
+// may show up to interval ms early; in exchange there are fewer, longer events.
+inline std::vector<Batch> coalesceBatches(const std::vector<Batch> &batches, int interval) {
+    TraceScope trace("coalesceBatches", static_cast<int64_t>(batches.size()));
+    std::vector<Batch> result;
+    for (const auto &batch: batches) {
+        if (!result.empty() && batch.time >= result.back().time && batch.time - result.back().time < interval) {
+            result.back().lines = batch.lines;
+            result.back().firstLine = batch.firstLine;
+        } else {
+            result.push_back(batch);
         }
+    }
+    return result;
+}
+
+// Color in the OKLab space, where euclidean distance roughly follows perceived difference.
+struct LabColor {
+    double L, a, b;
+
+    double operator[](int axis) const {
+        return axis == 0 ? L : axis == 1 ? a : b;
+    }
+
+    double distance2(const LabColor &other) const {
+        return (L - other.L) * (L - other.L) + (a - other.a) * (a - other.a) + (b - other.b) * (b - other.b);
+    }
+};
+
+inline LabColor toOkLab(const Color &color) {
+    auto linear = [](int v) {
+        double x = v / 255.0;
+        return x <= 0.04045 ? x / 12.92 : std::pow((x + 0.055) / 1.055, 2.4);
+    };
+    double r = linear(color.r), g = linear(color.g), b = linear(color.b);
+    double l = std::cbrt(0.4122214708 * r + 0.5363325363 * g + 0.0514459929 * b);
+    double m = std::cbrt(0.2119034982 * r + 0.6806995451 * g + 0.1073969566 * b);
+    double s = std::cbrt(0.0883024619 * r + 0.2817188376 * g + 0.6299787005 * b);
+    return {
+        0.2104542553 * l + 0.7936177850 * m - 0.0040720468 * s,
+        1.9779984951 * l - 2.4285922050 * m + 0.4505937099 * s,
+        0.0259040371 * l + 0.7827717662 * m - 0.8086757660 * s
+    };
+}
 
-        pen->SetAttribute("fs", enumToIntString(params.fontStyle).c_str());
-        pen->SetAttribute("sz", std::to_string(params.fontSizePercent).c_str());
-        head->InsertEndChild(pen);
-        kv.second = std::to_string(penIndex);
-        penIndex++;
-    }
-
-    // Create workspace element for whatever reason.
-    XMLElement *ws = doc.NewElement("ws");
-    ws->SetAttribute("id", "1"); // default workspace id
-    ws->SetAttribute("ju", enumToIntString(params.textAlignment).c_str());
-    head->InsertEndChild(ws);
-
-    // Create window position (wp) elements.
-    for (int i = 0; i < params.totalDisplayLines; ++i) {
-        XMLElement *wp = doc.NewElement("wp");
-        wp->SetAttribute("id", std::to_string(i).c_str());
-        wp->SetAttribute("ap", "0"); // anchor point
-        wp->SetAttribute("ah", std::to_string(params.horizontalMargin).c_str());
-        wp->SetAttribute("av", std::to_string(i * params.verticalSpacing).c_str());
-        head->InsertEndChild(wp);
-    }
-    // Zero-width space (ZWSP) as a UTF-8 string.
-    auto defaultPen = colors[params.textForegroundColor];
-    constexpr const char *ZWSP = "\xE2\x80\x8B";
-    for (size_t batchIndex = 0; batchIndex + 1 < batches.size(); ++batchIndex) {
-        const Batch &batch = batches[batchIndex];
-        const Batch &nextBatch = batches[batchIndex + 1];
-        if (params.verticalSpacing == -1) {
-            XMLElement *pElem = doc.NewElement("p");
-            pElem->SetAttribute("t", std::to_string(batch.time).c_str());
-            int duration = nextBatch.time - batch.time;
-            pElem->SetAttribute("d", std::to_string(duration).c_str());
-            pElem->SetAttribute("wp", "0");
-            pElem->SetAttribute("ws", "1");
-            pElem->SetAttribute("p", defaultPen.c_str());
-            pElem->LinkEndChild(doc.NewText(""));
-
-            for (const auto &[idx, line]: batch.lines | std::ranges::views::enumerate) {
-                if (line.user.has_value()) {
-                    XMLElement *sUser = doc.NewElement("s");
-                    sUser->SetAttribute("p", colors[line.user->color].c_str());
-                    std::string userText = line.user->name;
-                    sUser->SetText(userText.c_str());
-                    pElem->InsertEndChild(sUser);
-                    pElem->LinkEndChild(doc.NewText(ZWSP));
+// Clusters colors into at most k groups (median cut in OKLab, refined by a few k-means passes)
+// and maps every input color to its group's representative. Representatives are picked from the
+// input itself, so a quantized pen still shows a color some user actually chose.
+inline std::map<Color, Color> quantizeColors(const std::vector<Color> &colors, size_t k) {
+    TraceScope trace("quantizeColors", static_cast<int64_t>(colors.size()));
+    std::map<Color, Color> result;
+    if (k == 0 || colors.size() <= k) {
+        for (const auto &c: colors) result[c] = c;
+        return result;
+    }
+
+    std::vector<LabColor> lab;
+    lab.reserve(colors.size());
+    for (const auto &c: colors) lab.push_back(toOkLab(c));
+
+    // Median cut: keep splitting the box with the widest extent at its median.
+    std::vector<std::vector<size_t> > boxes(1);
+    for (size_t i = 0; i < colors.size(); ++i) boxes[0].push_back(i);
+    while (boxes.size() < k) {
+        size_t widestBox = 0;
+        int widestAxis = 0;
+        double widestRange = 0;
+        for (size_t bi = 0; bi < boxes.size(); ++bi) {
+            if (boxes[bi].size() < 2) continue;
+            for (int axis = 0; axis < 3; ++axis) {
+                auto [lo, hi] = std::ranges::minmax(boxes[bi] | std::views::transform([&](size_t i) { return lab[i][axis]; }));
+                if (hi - lo > widestRange) {
+                    widestRange = hi - lo;
+                    widestBox = bi;
+                    widestAxis = axis;
                 }
-                XMLElement *sText = doc.NewElement("s");
-                sText->SetAttribute("p", defaultPen.c_str());
-                sText->SetText(line.text.c_str());
-                pElem->InsertEndChild(sText);
-                pElem->LinkEndChild(doc.NewText("\n"));
             }
-            body->InsertEndChild(pElem);
-        } else {
-            for (const auto &[idx, line]: batch.lines | std::ranges::views::enumerate) {
-                XMLElement *pElem = doc.NewElement("p");
-                pElem->SetAttribute("t", std::to_string(batch.time).c_str());
-                int duration = nextBatch.time - batch.time;
-                pElem->SetAttribute("d", std::to_string(duration).c_str());
-                pElem->SetAttribute("wp", std::to_string(idx).c_str());
-                pElem->SetAttribute("ws", "1");
-                pElem->SetAttribute("p", defaultPen.c_str());
-
-                pElem->LinkEndChild(doc.NewText(""));
-                if (line.user.has_value()) {
-                    XMLElement *sUser = doc.NewElement("s");
-                    sUser->SetAttribute("p", colors[line.user->color].c_str());
-                    std::string userText = line.user->name;
-                    sUser->SetText(userText.c_str());
-                    pElem->InsertEndChild(sUser);
-                    pElem->LinkEndChild(doc.NewText(ZWSP));
-                }
-
-                XMLElement *sText = doc.NewElement("s");
-                sText->SetAttribute("p", defaultPen.c_str());
-                sText->SetText(line.text.c_str());
-                pElem->InsertEndChild(sText);
-                pElem->LinkEndChild(doc.NewText(""));
+        }
+        if (widestRange <= 0) break;
+        auto &box = boxes[widestBox];
+        auto middle = box.begin() + static_cast<std::ptrdiff_t>(box.size() / 2);
+        std::ranges::nth_element(box, middle, {}, [&](size_t i) { return lab[i][widestAxis]; });
+        std::vector<size_t> upper(middle, box.end());
+        box.erase(middle, box.end());
+        boxes.push_back(std::move(upper));
+    }
+
+    std::vector<LabColor> centers;
+    for (const auto &box: boxes) {
+        LabColor sum{0, 0, 0};
+        for (size_t i: box) {
+            sum.L += lab[i].L;
+            sum.a += lab[i].a;
+            sum.b += lab[i].b;
+        }
+        centers.push_back({sum.L / box.size(), sum.a / box.size(), sum.b / box.size()});
+    }
 
-                body->InsertEndChild(pElem);
+    std::vector<size_t> cluster(colors.size());
+    auto assign = [&] {
+        for (size_t i = 0; i < colors.size(); ++i) {
+            size_t best = 0;
+            for (size_t c = 1; c < centers.size(); ++c) {
+                if (lab[i].distance2(centers[c]) < lab[i].distance2(centers[best])) best = c;
             }
+            cluster[i] = best;
+        }
+    };
+    constexpr int refinePasses = 4;
+    for (int pass = 0; pass < refinePasses; ++pass) {
+        assign();
+        std::vector<LabColor> sums(centers.size(), {0, 0, 0});
+        std::vector<size_t> counts(centers.size(), 0);
+        for (size_t i = 0; i < colors.size(); ++i) {
+            sums[cluster[i]].L += lab[i].L;
+            sums[cluster[i]].a += lab[i].a;
+            sums[cluster[i]].b += lab[i].b;
+            counts[cluster[i]]++;
+        }
+        for (size_t c = 0; c < centers.size(); ++c) {
+            if (counts[c] == 0) continue;
+            centers[c] = {sums[c].L / counts[c], sums[c].a / counts[c], sums[c].b / counts[c]};
         }
     }
+    assign();
 
-    XMLPrinter printer;
-    doc.Print(&printer);
-    return printer.CStr();
+    std::vector<std::optional<size_t> > representative(centers.size());
+    for (size_t i = 0; i < colors.size(); ++i) {
+        auto &rep = representative[cluster[i]];
+        if (!rep || lab[i].distance2(centers[cluster[i]]) < lab[*rep].distance2(centers[cluster[i]])) rep = i;
+    }
+    for (size_t i = 0; i < colors.size(); ++i) {
+        result[colors[i]] = colors[*representative[cluster[i]]];
+    }
+    return result;
 }
 
 
-inline Color getRandomColor(const std::string &username) {
-    std::vector<Color> defaultColors = {
+// Twitch's default username colors.
+inline const std::vector<Color> &defaultUserColors() {
+    static const std::vector<Color> colors = {
         "#ff0000", "#0000ff", "#008000", "#b22222", "#ff7f50",
         "#9acd32", "#ff4500", "#2e8b57", "#daa520", "#d2691e",
         "#5f9ea0", "#1e90ff", "#ff69b4", "#8a2be2", "#00ff7f"
     };
+    return colors;
+}
+
+inline Color getRandomColor(const std::string &username) {
+    const auto &defaultColors = defaultUserColors();
     std::hash<std::string> hasher;
     return defaultColors[hasher(username) % defaultColors.size()];
 }
 
-// dumb and simple way to parse CSV
-inline std::vector<ChatMessage> parseCSV(const std::filesystem::path &filename, int timeMultiplier) {
-    std::vector<ChatMessage> messages;
-    std::ifstream file(filename);
-    std::string line;
-
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open file " << filename << "\n";
-        std::exit(-1);
-    }
-
-    std::getline(file, line);
-    if (line != "time,user_name,user_color,message") {
-        std::cerr << "Error: Unexpected CSV header format.\n";
-        std::exit(-1);
-    }
-
-    while (std::getline(file, line)) {
-        std::stringstream ss(line);
-        std::string field;
-        ChatMessage msg;
-
-        std::getline(ss, field, ',');
-        msg.time = std::stoi(field) * timeMultiplier;
-
-        std::getline(ss, msg.user.name, ',');
-
-        std::getline(ss, field, ',');
-        msg.user.color = field.empty() ? getRandomColor(msg.user.name) : Color(field);
+inline constexpr std::string_view csvHeader = "time,user_name,user_color,message";
 
-        std::getline(ss, msg.message);
-
-        if (msg.message.size() >= 2 &&
-            msg.message.front() == '"' &&
-            msg.message.back() == '"') {
-            msg.message = msg.message.substr(1, msg.message.size() - 2);
-        }
-
-        messages.emplace_back(std::move(msg));
-    }
-
-    return messages;
+// Lines of the chat CSV may end in \r\n as well as \n.
+inline std::string_view trimCSVLine(std::string_view line) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    return line;
 }
 
-inline float realFontScale(int yttFontSize) {
-    return static_cast<float>((100.0 + (yttFontSize - 100.0) / 4.0) / 100.0);
+inline bool isCSVHeader(std::string_view line) {
+    return trimCSVLine(line) == csvHeader;
 }
 
+// Parses one data line of the chat CSV. Throws std::invalid_argument when the time is not a number.
+// Fields are cut out of the line directly, a stringstream per line cost more than the parsing.
+inline ChatMessage parseCSVLine(std::string_view line, int timeMultiplier) {
+    line = trimCSVLine(line);
+    ChatMessage msg;
+    // Like getline(line, field, ','): the rest of the line when there is no more comma.
+    auto nextField = [&line] {
+        size_t comma = line.find(',');
+        std::string_view field = line.substr(0, comma);
+        line.remove_prefix(comma == std::string_view::npos ? line.size() : comma + 1);
+        return field;
+    };
 
-inline double assFontSize(const int yttFontSize, const int assHeight) {
-    return (realFontScale(yttFontSize) * 64.107) / 1440.0 * static_cast<double>(assHeight);
-}
+    std::string_view field = nextField();
+    try {
+        msg.time = static_cast<uint64_t>(static_cast<int64_t>(std::stoi(std::string(field))) * timeMultiplier);
+    } catch (const std::logic_error &) {
+        throw std::invalid_argument("Invalid time \"" + std::string(field) + "\"");
+    }
 
-inline double assX(int yttX, const int yttFontSize, const int assWidth) {
-    return (51.2821 + 24.5844 * yttX + 15.9109 * realFontScale(yttFontSize)) * assWidth / 2560.0;
-}
+    msg.user.name = nextField();
+
+    field = nextField();
+    msg.user.color = field.empty() ? getRandomColor(msg.user.name) : Color(std::string(field));
 
-inline double assY(const int yttY, const int yttFontSize, const int assHeight, const uint32_t line = 0) {
-    //     double rFontScale = realFontScale(yttFontSize);
-    //
-    // //    double lC = 3.4442 * rFontScale * rFontScale * rFontScale
-    // //                - 8.3489 * rFontScale * rFontScale
-    // //                + 74.5018 * rFontScale - 1.6156;
-    // //    double lC = 3.4441851202 * rFontScale * rFontScale * rFontScale
-    // //                - 8.3488610000 * rFontScale * rFontScale
-    // //                + 74.5018286601 * rFontScale - 1.6155972200;
-    //     double lC = 5.1862772740 * rFontScale * rFontScale * rFontScale
-    //                 - 14.1350956536 * rFontScale * rFontScale
-    //                 + 80.4294668977 * rFontScale - 3.3718297322;
-    const int yttY2 = yttY * yttY;
-    const int yttY3 = yttY2 * yttY;
-    const double fScale = realFontScale(yttFontSize);
-    const double fScale2 = fScale * fScale;
-
-    return ((0.0000036448 * fScale - 0.0000102298) * yttY3 +
-            (0.0001228929 * fScale + 0.0006313481) * yttY2 +
-            (-0.0299080260 * fScale + 13.8373127706) * yttY +
-            (2.3156363636 * fScale2 - 2.1625454545 * fScale + 30.1938181818) +
-            (2.095321207 * fScale2 + 64.752581827 * fScale + 1.158860604) * line
-           ) * assHeight / 1440.0;
+    if (line.size() >= 2 &&
+        line.front() == '"' &&
+        line.back() == '"') {
+        line = line.substr(1, line.size() - 2);
+    }
+    msg.message = line;
+    return msg;
 }
 
+// dumb and simple way to parse CSV
+// Throws std::runtime_error when the data is not a chat CSV; name says where it came from.
+inline std::vector<ChatMessage> parseCSV(std::istream &file, int timeMultiplier, const std::string &name) {
+    TraceScope trace("parseCSV");
+    std::vector<ChatMessage> messages;
+    std::string line;
 
-static std::string formatTime(uint64_t ms) {
-    uint64_t total = ms / 10;
-    uint64_t h = total / 360000;
-    uint64_t m = (total / 6000) % 60;
-    uint64_t s = (total / 100) % 60;
-    uint64_t cs = total % 100;
-    return std::format("{}:{:02}:{:02}.{:02}", h, m, s, cs);
-}
+    std::getline(file, line);
+    if (!isCSVHeader(line)) {
+        throw std::runtime_error("Unexpected CSV header format in " + name);
+    }
 
-static std::string escapeText(const std::string &raw) {
-    std::string out;
-    out.reserve(raw.size());
-    for (char c: raw) {
-        switch (c) {
-            case '\\':
-                out += "\\\\";
-                break;
-            case '{':
-                out += "\\{";
-                break;
-            case '}':
-                out += "\\}";
-                break;
-            case '\n':
-                out += "\\n";
-                break;
-            //TODO Improve this
-            default:
-                out += c;
-                break;
+    size_t lineNumber = 1;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        try {
+            messages.emplace_back(parseCSVLine(line, timeMultiplier));
+        } catch (const std::invalid_argument &e) {
+            throw std::runtime_error(std::string(e.what()) + " on line " + std::to_string(lineNumber) +
+                                     " of " + name);
         }
     }
-    return out;
-}
 
+    return messages;
+}
 
-inline std::string generateAss(const std::vector<Batch> &batches,
-                               const ChatParams &chat_params,
-                               int video_width, int video_height) {
-    static constexpr std::string_view header =
-            "\xEF\xBB\xBF" // BOM
-            "[Script Info]\n";
-    static constexpr std::string_view info =
-            "\n; Script generated by Kam1k4dze's SubChat\n"
-            "Title: SubChat preview\n"
-            "ScriptType: v4.00+\n"
-            "WrapStyle: 2\n"
-            "ScaledBorderAndShadow: yes\n"
-            "YCbCr Matrix: None\n";
-    static constexpr std::string_view stylesHeader =
-            "[V4+ Styles]\n"
-            "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, "
-            "Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, "
-            "Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding\n";
-    static constexpr std::string_view eventsHeader =
-            "[Events]\n"
-            "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n";
-
-    static std::string ass;
-    ass.clear();
-    ass += header;
-    ass += info;
-    ass += std::format("PlayResX: {}\nPlayResY: {}\nLayoutResX: {}\nLayoutResY: {}\n\n",
-                       video_width, video_height, video_width, video_height);
-    ass += stylesHeader;
-    float fontSize = assFontSize(chat_params.fontSizePercent, video_height);
-    ass += std::format(
-        "Style: Default,Lucida Console,{:.2f},&H00000000,&H000000FF,&H00000000,&H00000000,"
-        "0,0,0,0,100,100,0,0,1,0,2.5,7,0,0,0,1\n\n",
-        fontSize
-    );
-    ass += eventsHeader;
-    double posX = assX(chat_params.horizontalMargin, chat_params.fontSizePercent, video_width);
-    size_t maxLines = chat_params.totalDisplayLines;
-    std::vector<double> posY(maxLines);
-    for (size_t idx = 0; idx < maxLines; ++idx) {
-        posY[idx] = (chat_params.verticalSpacing < 0)
-                        ? assY(chat_params.verticalMargin, chat_params.fontSizePercent, video_height, idx)
-                        : assY(chat_params.verticalMargin + chat_params.verticalSpacing * idx,
-                               chat_params.fontSizePercent, video_height);
-    }
-
-    for (size_t i = 0; i + 1 < batches.size(); ++i) {
-        const auto &curr = batches[i];
-        const auto &next = batches[i + 1];
-        auto start = formatTime(curr.time);
-        auto end = formatTime(next.time);
-
-        for (size_t idx = 0; idx < curr.lines.size(); ++idx) {
-            const auto &line = curr.lines[idx];
-            std::format_to(std::back_inserter(ass),
-                           "Dialogue: 0,{},{},Default,,0,0,0,,{{\\pos({:.3f},{:.3f})}}",
-                           start, end, posX, posY[idx]
-            );
-
-            if (line.user) {
-                ass += line.user->color.toAssColor();
-                ass += escapeText(line.user->name);
-            }
-            ass += chat_params.textForegroundColor.toAssColor();
-            ass += escapeText(line.text);
-            ass += '\n';
-        }
+// Throws std::runtime_error when the file cannot be read or is not a chat CSV.
+inline std::vector<ChatMessage> parseCSV(const std::filesystem::path &filename, int timeMultiplier) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file " + filename.string());
     }
-
-    return ass;
+    return parseCSV(file, timeMultiplier, filename.string());
 }